@@ -0,0 +1,383 @@
+#include "archive.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const uint32 ARCHIVE_MAGIC = 0x41534154;  // "TASA"
+static const uint32 ARCHIVE_VERSION = 1;
+// Records start after the header, on their own page.
+static const uint64 HEADER_BYTES = 4096;
+static const uint32 RECORD_MAGIC = 0x44434552;  // "RECD"
+static const uint64 INITIAL_CAPACITY = 4096;
+
+// At the start of the states file. Changed only under the lock.
+struct StateArchive::Header {
+  uint32 magic;
+  uint32 version;
+  uint64 game;
+  // Records end here.
+  uint64 end;
+  // Slots in the current index file, and how many are used. When
+  // the capacity changes, the index was rebuilt and has to be opened
+  // again.
+  uint64 capacity;
+  uint64 count;
+};
+
+// An empty slot has k0 == 0, and k0 is written last.
+struct StateArchive::Slot {
+  uint64 k0, k1;
+  uint64 offset;
+};
+
+namespace {
+// Followed by the inputs, then the state, then padding to 8 bytes.
+struct RecordHeader {
+  uint32 magic;
+  uint32 num_inputs;
+  uint32 state_size;
+  uint32 unused;
+  uint64 fingerprint[2];
+  uint64 parent[2];
+};
+
+// Holds a write lock on the file's first byte for as long as it
+// lives. These are fcntl record locks, which belong to the process:
+// an flock belongs to the open file, which forked workers share, so
+// they would all hold it at once.
+struct Lock {
+  explicit Lock(int fd) : fd(fd) { Set(F_WRLCK); }
+  ~Lock() { Set(F_UNLCK); }
+  void Set(short type) {
+    struct flock fl;
+    memset(&fl, 0, sizeof (fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 1;
+    while (0 != fcntl(fd, F_SETLKW, &fl)) CHECK(errno == EINTR);
+  }
+  int fd;
+};
+}
+
+static inline uint64 Load64(const uint64 *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void Store64(uint64 *p, uint64 v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static inline void StateKey(uint128 fp, uint64 *k0, uint64 *k1) {
+  *k0 = Uint128Low64(fp);
+  *k1 = Uint128High64(fp);
+  if (*k0 == 0) *k0 = 1;
+}
+
+// Different from any state key, with overwhelming probability.
+static inline void ChildKey(uint128 parent, const vector<uint8> &inputs,
+			    uint64 *k0, uint64 *k1) {
+  CHECK(!inputs.empty());
+  const uint128 h = CityHash128WithSeed((const char *)&inputs[0],
+					inputs.size(), parent);
+  *k0 = Uint128Low64(h) ^ 0x6368696C64ULL;
+  *k1 = Uint128High64(h);
+  if (*k0 == 0) *k0 = 1;
+}
+
+static void WriteAll(int fd, const uint8 *p, size_t n, uint64 at) {
+  while (n > 0) {
+    const ssize_t wrote = pwrite(fd, p, n, at);
+    if (wrote <= 0) {
+      fprintf(stderr, "Couldn't write to state archive\n");
+      abort();
+    }
+    p += wrote;
+    n -= wrote;
+    at += wrote;
+  }
+}
+
+StateArchive::StateArchive()
+  : max_bytes(0ULL), fd(-1), data(NULL), header(NULL),
+    index_fd(-1), index(NULL), index_bytes(0ULL), capacity(0ULL),
+    hits(0ULL), misses(0ULL), puts(0ULL), full(0ULL) {}
+
+StateArchive::~StateArchive() {
+  if (index != NULL) munmap(index, index_bytes);
+  if (index_fd >= 0) close(index_fd);
+  if (data != NULL) munmap(data, max_bytes);
+  if (fd >= 0) close(fd);
+}
+
+StateArchive *StateArchive::Open(const string &basename, uint64 game,
+				 uint64 max_bytes) {
+  StateArchive *a = new StateArchive;
+  a->basename = basename;
+  const string filename = basename + ".states";
+  a->fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+  if (a->fd < 0) {
+    fprintf(stderr, "Couldn't open state archive %s\n", filename.c_str());
+    abort();
+  }
+
+  Lock lock(a->fd);
+  struct stat st;
+  CHECK(0 == fstat(a->fd, &st));
+  if (st.st_size == 0) {
+    Header h;
+    memset(&h, 0, sizeof (h));
+    h.magic = ARCHIVE_MAGIC;
+    h.version = ARCHIVE_VERSION;
+    h.game = game;
+    h.end = HEADER_BYTES;
+    CHECK(0 == ftruncate(a->fd, HEADER_BYTES));
+    WriteAll(a->fd, (const uint8 *)&h, sizeof (h), 0);
+    st.st_size = HEADER_BYTES;
+  }
+
+  // Map all the space it may grow into now, so that it never has to
+  // be mapped again. Only what's in the file can be touched.
+  a->max_bytes = max_bytes > (uint64)st.st_size ? max_bytes : st.st_size;
+  void *m = mmap(NULL, a->max_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+		 a->fd, 0);
+  if (m == MAP_FAILED) {
+    fprintf(stderr, "Couldn't map state archive %s\n", filename.c_str());
+    abort();
+  }
+  a->data = (uint8 *)m;
+  a->header = (Header *)m;
+
+  if (a->header->magic != ARCHIVE_MAGIC ||
+      a->header->version != ARCHIVE_VERSION) {
+    fprintf(stderr, "%s isn't a state archive\n", filename.c_str());
+    abort();
+  }
+  if (a->header->game != game) {
+    fprintf(stderr, "State archive %s is for a different game\n",
+	    filename.c_str());
+    abort();
+  }
+
+  if (a->header->capacity == 0) {
+    a->Grow();
+  } else {
+    a->OpenIndex();
+  }
+  return a;
+}
+
+void StateArchive::OpenIndex() {
+  if (index != NULL) munmap(index, index_bytes);
+  if (index_fd >= 0) close(index_fd);
+
+  const string filename = basename + ".index";
+  index_fd = open(filename.c_str(), O_RDWR);
+  if (index_fd < 0) {
+    fprintf(stderr, "Couldn't open state archive index %s\n",
+	    filename.c_str());
+    abort();
+  }
+  // The file may already be newer than the header we read, so its
+  // size is what counts.
+  struct stat st;
+  CHECK(0 == fstat(index_fd, &st));
+  index_bytes = st.st_size;
+  capacity = index_bytes / sizeof (Slot);
+  CHECK(capacity > 0 && (capacity & (capacity - 1)) == 0);
+  void *m = mmap(NULL, index_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+		 index_fd, 0);
+  if (m == MAP_FAILED) {
+    fprintf(stderr, "Couldn't map state archive index %s\n",
+	    filename.c_str());
+    abort();
+  }
+  index = (uint8 *)m;
+}
+
+// Called with the lock held. Writes a new index with twice the
+// capacity and renames it over the old one; other processes notice
+// the new capacity in the header.
+void StateArchive::Grow() {
+  const uint64 newcap =
+    header->capacity == 0 ? INITIAL_CAPACITY : header->capacity * 2;
+  const string filename = basename + ".index";
+  // Named for this process, so writers never share one.
+  const string tmpname = StringPrintf("%s.tmp.%d", filename.c_str(),
+				      (int)getpid());
+  const int tfd = open(tmpname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (tfd < 0) {
+    fprintf(stderr, "Couldn't create %s\n", tmpname.c_str());
+    abort();
+  }
+  const uint64 bytes = newcap * sizeof (Slot);
+  CHECK(0 == ftruncate(tfd, bytes));
+  void *m = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, tfd, 0);
+  CHECK(m != MAP_FAILED);
+  Slot *slots = (Slot *)m;
+
+  uint64 count = 0;
+  if (header->capacity != 0) {
+    if (capacity != header->capacity) OpenIndex();
+    const Slot *old = (const Slot *)index;
+    for (uint64 i = 0; i < capacity; i++) {
+      if (old[i].k0 == 0) continue;
+      uint64 j = old[i].k0 & (newcap - 1);
+      while (slots[j].k0 != 0) j = (j + 1) & (newcap - 1);
+      slots[j] = old[i];
+      count++;
+    }
+  }
+  munmap(m, bytes);
+  close(tfd);
+
+  if (0 != rename(tmpname.c_str(), filename.c_str())) {
+    fprintf(stderr, "Couldn't replace %s\n", filename.c_str());
+    abort();
+  }
+  header->count = count;
+  Store64(&header->capacity, newcap);
+  OpenIndex();
+}
+
+bool StateArchive::ReadRecord(uint64 offset, Record *rec) const {
+  // Another process that opened it with a bigger max_bytes can
+  // append past the end of this one's mapping; those are misses.
+  const uint64 end = std::min(Load64(&header->end), max_bytes);
+  if (offset < HEADER_BYTES || offset + sizeof (RecordHeader) > end)
+    return false;
+  const RecordHeader *rh = (const RecordHeader *)(data + offset);
+  if (rh->magic != RECORD_MAGIC) return false;
+  const uint64 size =
+    sizeof (RecordHeader) + (uint64)rh->num_inputs + rh->state_size;
+  if (offset + size > end) return false;
+  rec->fingerprint = uint128(rh->fingerprint[0], rh->fingerprint[1]);
+  rec->parent = uint128(rh->parent[0], rh->parent[1]);
+  rec->inputs = data + offset + sizeof (RecordHeader);
+  rec->num_inputs = rh->num_inputs;
+  rec->state = rec->inputs + rh->num_inputs;
+  rec->state_size = rh->state_size;
+  return true;
+}
+
+template<class F>
+bool StateArchive::Lookup(uint64 k0, uint64 k1, const F &matches,
+			  Record *rec) {
+  if (Load64(&header->capacity) != capacity) OpenIndex();
+  Slot *slots = (Slot *)index;
+  const uint64 mask = capacity - 1;
+  for (uint64 n = 0, i = k0 & mask; n < capacity; n++, i = (i + 1) & mask) {
+    const uint64 s0 = Load64(&slots[i].k0);
+    if (s0 == 0) return false;
+    if (s0 == k0 && slots[i].k1 == k1 &&
+	ReadRecord(slots[i].offset, rec) && matches(*rec))
+      return true;
+  }
+  return false;
+}
+
+bool StateArchive::Find(uint128 fingerprint, Record *rec) {
+  uint64 k0, k1;
+  StateKey(fingerprint, &k0, &k1);
+  const bool found = Lookup(k0, k1, [&](const Record &r) {
+      return r.fingerprint == fingerprint;
+    }, rec);
+  if (found) hits++; else misses++;
+  return found;
+}
+
+bool StateArchive::FindChild(uint128 parent, const vector<uint8> &inputs,
+			     Record *rec) {
+  uint64 k0, k1;
+  ChildKey(parent, inputs, &k0, &k1);
+  const bool found = Lookup(k0, k1, [&](const Record &r) {
+      return r.parent == parent && r.num_inputs == inputs.size() &&
+	0 == memcmp(r.inputs, &inputs[0], inputs.size());
+    }, rec);
+  if (found) hits++; else misses++;
+  return found;
+}
+
+// Called with the lock held.
+void StateArchive::Insert(uint64 k0, uint64 k1, uint64 offset) {
+  if (header->capacity != capacity) OpenIndex();
+  if ((header->count + 1) * 2 > header->capacity) Grow();
+  Slot *slots = (Slot *)index;
+  const uint64 mask = capacity - 1;
+  uint64 i = k0 & mask;
+  while (slots[i].k0 != 0) i = (i + 1) & mask;
+  slots[i].offset = offset;
+  slots[i].k1 = k1;
+  Store64(&slots[i].k0, k0);
+  header->count++;
+}
+
+bool StateArchive::Put(uint128 fingerprint, uint128 parent,
+		       const vector<uint8> &inputs,
+		       const vector<uint8> &state) {
+  CHECK(!inputs.empty() && !state.empty());
+  uint64 s0, s1, c0, c1;
+  StateKey(fingerprint, &s0, &s1);
+  ChildKey(parent, inputs, &c0, &c1);
+  Record rec;
+  auto same = [&](const Record &r) {
+    return r.fingerprint == fingerprint && r.parent == parent &&
+      r.num_inputs == inputs.size() &&
+      0 == memcmp(r.inputs, &inputs[0], inputs.size());
+  };
+  if (Lookup(c0, c1, same, &rec)) return true;
+
+  Lock lock(fd);
+  // Someone else may have just written it.
+  if (Lookup(c0, c1, same, &rec)) return true;
+
+  const uint64 size = (sizeof (RecordHeader) + inputs.size() +
+		       state.size() + 7) & ~7ULL;
+  const uint64 offset = header->end;
+  if (offset + size > max_bytes) {
+    full++;
+    return false;
+  }
+
+  vector<uint8> buf(size, 0);
+  RecordHeader *rh = (RecordHeader *)&buf[0];
+  rh->magic = RECORD_MAGIC;
+  rh->num_inputs = inputs.size();
+  rh->state_size = state.size();
+  rh->fingerprint[0] = Uint128Low64(fingerprint);
+  rh->fingerprint[1] = Uint128High64(fingerprint);
+  rh->parent[0] = Uint128Low64(parent);
+  rh->parent[1] = Uint128High64(parent);
+  memcpy(&buf[sizeof (RecordHeader)], &inputs[0], inputs.size());
+  memcpy(&buf[sizeof (RecordHeader) + inputs.size()],
+	 &state[0], state.size());
+  WriteAll(fd, &buf[0], size, offset);
+  Store64(&header->end, offset + size);
+
+  Insert(s0, s1, offset);
+  Insert(c0, c1, offset);
+  puts++;
+  return true;
+}
+
+uint64 StateArchive::Bytes() const {
+  return Load64(&header->end);
+}
+
+void StateArchive::PrintStats() const {
+  printf("State archive %s: %.1f / %.1f MB, %llu index slots used of "
+	 "%llu\n"
+	 "%llu hits and %llu misses; %llu puts, %llu when full\n",
+	 basename.c_str(), Bytes() / (1024.0 * 1024.0),
+	 max_bytes / (1024.0 * 1024.0),
+	 (unsigned long long)header->count, (unsigned long long)capacity,
+	 (unsigned long long)hits, (unsigned long long)misses,
+	 (unsigned long long)puts, (unsigned long long)full);
+}
@@ -0,0 +1,89 @@
+/* A savestate archive on disk, shared by every process that opens
+   it and kept across runs. It's two files: basename.states, where
+   records are only ever appended, and basename.index, a hash table
+   over them. Both are mapped into memory, so processes on the same
+   machine share one copy through the page cache, and a state is
+   loaded straight from the mapping.
+
+   Each record is a state (as from Emulator::SaveUncompressed) with
+   its fingerprint (Emulator::StateFingerprint) and where it came
+   from: the fingerprint of the state it was reached from and the
+   inputs that got there. Records can be looked up either way.
+
+   Any number of processes can read and write at once, including
+   ones forked from a process that has it open. Writers take a
+   (per-process) lock on the states file; readers don't lock, and
+   check every record they find, so at worst they miss one that's
+   being written.
+   The archive only grows, up to the size given to Open. */
+
+#ifndef __TASBOT_ARCHIVE_H
+#define __TASBOT_ARCHIVE_H
+
+#include <string>
+#include <vector>
+
+#include "tasbot.h"
+#include "../cc-lib/city/city.h"
+
+struct StateArchive {
+  // A record, pointing into the mapping.
+  struct Record {
+    uint128 fingerprint;
+    uint128 parent;
+    const uint8 *inputs;
+    uint32 num_inputs;
+    const uint8 *state;
+    uint32 state_size;
+  };
+
+  // Opens the archive, creating it if it doesn't exist. game
+  // identifies the game (and anything else states depend on); it's
+  // an error to open an archive made for a different one. Aborts on
+  // failure.
+  static StateArchive *Open(const string &basename, uint64 game,
+			    uint64 max_bytes);
+  ~StateArchive();
+
+  bool Find(uint128 fingerprint, Record *rec);
+  // The record reached from parent by exactly these inputs.
+  bool FindChild(uint128 parent, const vector<uint8> &inputs, Record *rec);
+
+  // Adds a record unless one with the same fingerprint and
+  // provenance is already there. Returns false if the archive is
+  // full.
+  bool Put(uint128 fingerprint, uint128 parent,
+	   const vector<uint8> &inputs, const vector<uint8> &state);
+
+  uint64 Bytes() const;
+  void PrintStats() const;
+
+ private:
+  struct Header;
+  struct Slot;
+
+  StateArchive();
+  void OpenIndex();
+  void Grow();
+  // Looks up the record under a key, calling matches on each
+  // candidate until it returns true.
+  template<class F>
+  bool Lookup(uint64 k0, uint64 k1, const F &matches, Record *rec);
+  bool ReadRecord(uint64 offset, Record *rec) const;
+  void Insert(uint64 k0, uint64 k1, uint64 offset);
+
+  string basename;
+  uint64 max_bytes;
+  int fd;
+  uint8 *data;
+  Header *header;
+
+  int index_fd;
+  uint8 *index;
+  uint64 index_bytes;
+  uint64 capacity;
+
+  uint64 hits, misses, puts, full;
+};
+
+#endif
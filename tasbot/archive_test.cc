@@ -0,0 +1,162 @@
+/* Tests for the on-disk state archive. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "tasbot.h"
+#include "../cc-lib/util.h"
+#include "../cc-lib/arcfour.h"
+#include "archive.h"
+
+static const uint64 GAME = 0x5EEDULL;
+
+// Everything about record i is a function of i.
+static void MakeRecord(int i, uint128 *fp, uint128 *parent,
+		       vector<uint8> *inputs, vector<uint8> *state) {
+  ArcFour rc(StringPrintf("record%d", i));
+  *fp = uint128(0x1000 + i, rc.Byte());
+  *parent = uint128(i / 3, 7);
+  inputs->clear();
+  const int ninputs = 8 + rc.Byte() % 20;
+  for (int j = 0; j < ninputs; j++) inputs->push_back(rc.Byte());
+  state->resize(500 + rc.Byte());
+  for (int j = 0; j < state->size(); j++) (*state)[j] = rc.Byte();
+}
+
+static void CheckRecord(StateArchive *a, int i) {
+  uint128 fp, parent;
+  vector<uint8> inputs, state;
+  MakeRecord(i, &fp, &parent, &inputs, &state);
+
+  StateArchive::Record rec;
+  CHECK(a->Find(fp, &rec));
+  CHECK(rec.fingerprint == fp && rec.parent == parent);
+  CHECK(vector<uint8>(rec.state, rec.state + rec.state_size) == state);
+
+  CHECK(a->FindChild(parent, inputs, &rec));
+  CHECK(rec.fingerprint == fp);
+  CHECK(vector<uint8>(rec.inputs, rec.inputs + rec.num_inputs) == inputs);
+
+  // Same parent, different inputs.
+  inputs.push_back(0);
+  CHECK(!a->FindChild(parent, inputs, &rec));
+}
+
+static void PutRecords(StateArchive *a, int start, int end) {
+  for (int i = start; i < end; i++) {
+    uint128 fp, parent;
+    vector<uint8> inputs, state;
+    MakeRecord(i, &fp, &parent, &inputs, &state);
+    CHECK(a->Put(fp, parent, inputs, state));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  fprintf(stderr, "Testing state archive.\n");
+  const string base = StringPrintf("archive_test-%d", (int)getpid());
+
+  {
+    StateArchive *a = StateArchive::Open(base, GAME, 64 << 20);
+    StateArchive::Record rec;
+    CHECK(!a->Find(uint128(1, 2), &rec));
+    // Enough to grow the index a few times.
+    PutRecords(a, 0, 10000);
+    for (int i = 0; i < 10000; i += 7) CheckRecord(a, i);
+    // Putting it again doesn't add anything.
+    const uint64 bytes = a->Bytes();
+    PutRecords(a, 0, 100);
+    CHECK(a->Bytes() == bytes);
+    delete a;
+  }
+
+  // Kept across opens, and shared by writers in other processes.
+  {
+    StateArchive *a = StateArchive::Open(base, GAME, 64 << 20);
+    for (int i = 0; i < 10000; i += 13) CheckRecord(a, i);
+
+    static const int kProcs = 4, kEach = 3000;
+    for (int p = 0; p < kProcs; p++) {
+      if (fork() == 0) {
+	StateArchive *b = StateArchive::Open(base, GAME, 64 << 20);
+	PutRecords(b, 10000 + p * kEach, 10000 + (p + 1) * kEach);
+	// Including each other's, partway through.
+	delete b;
+	_exit(0);
+      }
+    }
+    for (int p = 0; p < kProcs; p++) {
+      int status = 0;
+      CHECK(wait(&status) > 0);
+      CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    // This one still has the index from before the others grew it.
+    for (int i = 0; i < 10000 + kProcs * kEach; i += 11) CheckRecord(a, i);
+    a->PrintStats();
+    delete a;
+  }
+
+  // Forked workers share the parent's open archive, and must still
+  // take turns writing.
+  {
+    StateArchive *a = StateArchive::Open(base, GAME, 64 << 20);
+    static const int kProcs = 4, kEach = 2000, kStart = 30000;
+    for (int p = 0; p < kProcs; p++) {
+      if (fork() == 0) {
+	PutRecords(a, kStart + p * kEach, kStart + (p + 1) * kEach);
+	_exit(0);
+      }
+    }
+    for (int p = 0; p < kProcs; p++) {
+      int status = 0;
+      CHECK(wait(&status) > 0);
+      CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    for (int i = kStart; i < kStart + kProcs * kEach; i++) CheckRecord(a, i);
+    delete a;
+  }
+
+  // Full: no more puts, but everything is still there.
+  {
+    StateArchive *a = StateArchive::Open(base, GAME, 1 << 20);
+    uint128 fp, parent;
+    vector<uint8> inputs, state;
+    MakeRecord(99999, &fp, &parent, &inputs, &state);
+    CHECK(!a->Put(fp, parent, inputs, state));
+    CheckRecord(a, 12345);
+    delete a;
+  }
+
+  unlink((base + ".states").c_str());
+  unlink((base + ".index").c_str());
+
+  // Opened with a smaller limit than another process that keeps
+  // appending: records past this one's mapping are just misses.
+  {
+    StateArchive *a = StateArchive::Open(base, GAME, 1 << 20);
+    StateArchive *b = StateArchive::Open(base, GAME, 64 << 20);
+    PutRecords(b, 0, 4000);
+    CHECK(b->Bytes() > (1 << 20));
+    int found = 0;
+    for (int i = 0; i < 4000; i++) {
+      uint128 fp, parent;
+      vector<uint8> inputs, state;
+      MakeRecord(i, &fp, &parent, &inputs, &state);
+      StateArchive::Record rec;
+      if (a->FindChild(parent, inputs, &rec)) {
+	CHECK(vector<uint8>(rec.state, rec.state + rec.state_size) == state);
+	found++;
+      }
+    }
+    CHECK(found > 0 && found < 4000);
+    delete b;
+    delete a;
+  }
+
+  unlink((base + ".states").c_str());
+  unlink((base + ".index").c_str());
+  fprintf(stderr, "OK.\n");
+  return 0;
+}
@@ -0,0 +1,206 @@
+#include "checkpoints.h"
+
+#include <chrono>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "fceu/state.h"
+
+// Every this many entries, a warm or cold one is coded on its own
+// rather than against the one before, so decoding never has to go
+// back further than this.
+static const int KEYFRAME_EVERY = 16;
+
+CheckpointStore::CheckpointStore(int hot, uint64 warm_bytes,
+				 const string &spill_file)
+  : hot(hot), warm_bytes(warm_bytes), spill_file(spill_file),
+    num_demoted(0), num_cold(0), warm_total(0ULL),
+    last_demoted_valid(false),
+    fd(-1), spill_end(0ULL), mapped(NULL), mapped_size(0ULL) {
+  CHECK(hot > 0);
+  for (int t = 0; t < NUM_TIERS; t++) {
+    gets[t] = 0ULL;
+    seconds[t] = 0.0;
+  }
+}
+
+CheckpointStore::~CheckpointStore() {
+  if (mapped != NULL) munmap((void *)mapped, mapped_size);
+  if (fd >= 0) close(fd);
+}
+
+void CheckpointStore::Push(int movenum, const vector<uint8> &state) {
+  CHECK(entries.empty() || movenum > entries.back().movenum);
+  entries.push_back(Entry());
+  Entry *e = &entries.back();
+  e->movenum = movenum;
+  e->tier = HOT;
+  e->data = state;
+  e->offset = 0ULL;
+  e->size = 0;
+
+  while ((int)entries.size() - num_demoted > hot)
+    Demote(num_demoted);
+  if (warm_total > warm_bytes)
+    Spill();
+}
+
+void CheckpointStore::GetDelta(int idx, const uint8 **delta,
+			       uint32 *size) const {
+  const Entry &e = entries[idx];
+  if (e.tier == WARM) {
+    *delta = &e.data[0];
+    *size = e.data.size();
+  } else {
+    CHECK(e.tier == COLD);
+    CHECK(e.offset + e.size <= mapped_size);
+    *delta = mapped + e.offset;
+    *size = e.size;
+  }
+}
+
+void CheckpointStore::Decode(int idx, vector<uint8> *state) const {
+  vector<uint8> prev;
+  state->clear();
+  for (int i = idx - idx % KEYFRAME_EVERY; i <= idx; i++) {
+    const uint8 *delta;
+    uint32 size;
+    GetDelta(i, &delta, &size);
+    state->swap(prev);
+    CHECK(FCEUSS_DecodeDelta(delta, size,
+			     prev.empty() ? NULL : &prev[0], prev.size(),
+			     state));
+  }
+}
+
+void CheckpointStore::Demote(int idx) {
+  CHECK(idx == num_demoted);
+  Entry *e = &entries[idx];
+  CHECK(e->tier == HOT);
+
+  if (idx % KEYFRAME_EVERY == 0) {
+    last_demoted.clear();
+  } else if (!last_demoted_valid) {
+    Decode(idx - 1, &last_demoted);
+  }
+
+  vector<uint8> delta;
+  FCEUSS_EncodeDelta(&e->data[0], e->data.size(),
+		     last_demoted.empty() ? NULL : &last_demoted[0],
+		     last_demoted.size(), &delta);
+  last_demoted.swap(e->data);
+  last_demoted_valid = true;
+  e->data.swap(delta);
+  e->tier = WARM;
+  warm_total += e->data.size();
+  num_demoted++;
+}
+
+void CheckpointStore::Spill() {
+  if (fd < 0) {
+    fd = open(spill_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+      fprintf(stderr, "Couldn't open checkpoint spill file %s\n",
+	      spill_file.c_str());
+      abort();
+    }
+    // Keep using it, but don't leave it behind.
+    unlink(spill_file.c_str());
+  }
+
+  // Spill a good amount at once, since each time remaps the file.
+  while (num_cold < num_demoted && warm_total > warm_bytes * 3 / 4) {
+    Entry *e = &entries[num_cold];
+    CHECK(e->tier == WARM);
+    const uint8 *p = &e->data[0];
+    size_t left = e->data.size();
+    uint64 at = spill_end;
+    while (left > 0) {
+      const ssize_t wrote = pwrite(fd, p, left, at);
+      if (wrote <= 0) {
+	fprintf(stderr, "Couldn't write checkpoint spill file\n");
+	abort();
+      }
+      p += wrote;
+      at += wrote;
+      left -= wrote;
+    }
+    e->offset = spill_end;
+    e->size = e->data.size();
+    spill_end += e->size;
+    warm_total -= e->size;
+    vector<uint8>().swap(e->data);
+    e->tier = COLD;
+    num_cold++;
+  }
+  Remap();
+}
+
+void CheckpointStore::Remap() {
+  if (spill_end <= mapped_size) return;
+  if (mapped != NULL) munmap((void *)mapped, mapped_size);
+  void *m = mmap(NULL, spill_end, PROT_READ, MAP_SHARED, fd, 0);
+  if (m == MAP_FAILED) {
+    fprintf(stderr, "Couldn't map checkpoint spill file\n");
+    abort();
+  }
+  mapped = (const uint8 *)m;
+  mapped_size = spill_end;
+}
+
+void CheckpointStore::Get(int idx, vector<uint8> *state) {
+  CHECK(idx >= 0 && idx < entries.size());
+  using Clock = std::chrono::steady_clock;
+  const Clock::time_point start = Clock::now();
+
+  const Entry &e = entries[idx];
+  if (e.tier == HOT) {
+    *state = e.data;
+  } else if (idx == num_demoted - 1 && last_demoted_valid) {
+    *state = last_demoted;
+  } else {
+    Decode(idx, state);
+  }
+
+  gets[e.tier]++;
+  seconds[e.tier] +=
+    std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void CheckpointStore::Truncate(int movenum) {
+  while (!entries.empty() && entries.back().movenum > movenum) {
+    const Entry &e = entries.back();
+    if (e.tier != HOT) {
+      if (e.tier == WARM) {
+	warm_total -= e.data.size();
+      } else {
+	// Cold entries are in the file in order, so this is the end.
+	spill_end = e.offset;
+	num_cold--;
+      }
+      num_demoted--;
+      last_demoted_valid = false;
+    }
+    entries.pop_back();
+  }
+}
+
+void CheckpointStore::PrintStats() const {
+  static const char *const names[NUM_TIERS] = { "hot", "warm", "cold" };
+  uint64 hot_bytes = 0ULL;
+  for (int i = num_demoted; i < entries.size(); i++)
+    hot_bytes += entries[i].data.size();
+  printf("Checkpoints: %d hot (%.1f KB), %d warm (%.1f KB), "
+	 "%d cold (%.1f KB in file)\n",
+	 (int)entries.size() - num_demoted, hot_bytes / 1024.0,
+	 num_demoted - num_cold, warm_total / 1024.0,
+	 num_cold, spill_end / 1024.0);
+  for (int t = 0; t < NUM_TIERS; t++) {
+    if (gets[t] == 0) continue;
+    printf("  %llu %s gets, %.1f us each\n",
+	   (unsigned long long)gets[t], names[t],
+	   1e6 * seconds[t] / gets[t]);
+  }
+}
@@ -0,0 +1,86 @@
+/* Savestates kept at regular points along a long movie, so that
+   search can go back to them. A run can make thousands, so only the
+   most recent few are kept as they are (the hot tier). Older ones are
+   coded as deltas from the one before (the warm tier), which makes
+   them a few hundred bytes instead of tens of kilobytes, and once
+   those use too much memory the oldest move to a file that's mapped
+   into memory (the cold tier). Get works the same for any tier and
+   keeps track of how long each one takes. */
+
+#ifndef __TASBOT_CHECKPOINTS_H
+#define __TASBOT_CHECKPOINTS_H
+
+#include <string>
+#include <vector>
+
+#include "tasbot.h"
+
+struct CheckpointStore {
+  // Keeps the newest hot states uncompressed, and up to warm_bytes of
+  // deltas in memory. The cold tier goes in spill_file, which is
+  // created when it's first needed and deleted right away, so it's
+  // gone when the process exits.
+  CheckpointStore(int hot, uint64 warm_bytes, const string &spill_file);
+  ~CheckpointStore();
+
+  // Adds a state (as from Emulator::SaveUncompressed) for the given
+  // move number, which must be larger than any before.
+  void Push(int movenum, const vector<uint8> &state);
+
+  // Checkpoints are indexed from 0 (the oldest).
+  int Size() const { return entries.size(); }
+  int MoveNum(int idx) const { return entries[idx].movenum; }
+  void Get(int idx, vector<uint8> *state);
+
+  // Removes the checkpoints after movenum.
+  void Truncate(int movenum);
+
+  void PrintStats() const;
+
+ private:
+  enum Tier { HOT, WARM, COLD, NUM_TIERS };
+
+  struct Entry {
+    int movenum;
+    Tier tier;
+    // The state if HOT, or the delta if WARM.
+    vector<uint8> data;
+    // Where the delta is in the spill file, if COLD.
+    uint64 offset;
+    uint32 size;
+  };
+
+  // Gets the delta for a WARM or COLD entry.
+  void GetDelta(int idx, const uint8 **delta, uint32 *size) const;
+  // Decodes a WARM or COLD entry, starting from the last keyframe.
+  void Decode(int idx, vector<uint8> *state) const;
+  void Demote(int idx);
+  void Spill();
+  void Remap();
+
+  const int hot;
+  const uint64 warm_bytes;
+  const string spill_file;
+
+  vector<Entry> entries;
+  // Entries before this one are WARM or COLD.
+  int num_demoted;
+  // Entries before this one are COLD.
+  int num_cold;
+  uint64 warm_total;
+
+  // The state of entry num_demoted - 1, which the next one to be
+  // demoted is coded against, if last_demoted_valid.
+  vector<uint8> last_demoted;
+  bool last_demoted_valid;
+
+  int fd;
+  uint64 spill_end;
+  const uint8 *mapped;
+  uint64 mapped_size;
+
+  uint64 gets[NUM_TIERS];
+  double seconds[NUM_TIERS];
+};
+
+#endif
@@ -0,0 +1,82 @@
+/* Tests for the tiered checkpoint store. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "tasbot.h"
+#include "../cc-lib/util.h"
+#include "../cc-lib/arcfour.h"
+#include "checkpoints.h"
+
+// Like savestates from a movie: each a small change from the last.
+static void NextState(ArcFour *rc, vector<uint8> *state) {
+  const int changes = rc->Byte() % 20;
+  for (int i = 0; i < changes; i++) {
+    const int pos = ((rc->Byte() << 8) | rc->Byte()) % state->size();
+    (*state)[pos] = rc->Byte();
+  }
+}
+
+static void CheckAll(CheckpointStore *store,
+		     const vector< vector<uint8> > &expected,
+		     const vector<int> &movenums) {
+  CHECK(store->Size() == expected.size());
+  // Out of order, so it's not just the newest ones.
+  for (int k = 0; k < expected.size(); k++) {
+    const int i = (k * 7) % expected.size();
+    CHECK(store->MoveNum(i) == movenums[i]);
+    vector<uint8> state;
+    store->Get(i, &state);
+    if (state != expected[i]) {
+      fprintf(stderr, "Checkpoint %d (move %d) differs.\n", i, movenums[i]);
+      abort();
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  fprintf(stderr, "Testing checkpoints.\n");
+  ArcFour rc("checkpoints");
+
+  // Small enough limits that all three tiers get used.
+  CheckpointStore store(4, 4096,
+			StringPrintf("checkpoints_test-%d.spill",
+				     (int)getpid()));
+  vector< vector<uint8> > expected;
+  vector<int> movenums;
+  vector<uint8> state(3000, 0);
+  for (int i = 0; i < 3000; i++) state[i] = (i % 7 == 0) ? rc.Byte() : 0;
+
+  for (int i = 0; i < 200; i++) {
+    NextState(&rc, &state);
+    store.Push(i * 100, state);
+    expected.push_back(state);
+    movenums.push_back(i * 100);
+  }
+  CheckAll(&store, expected, movenums);
+
+  // Go back into each tier, and grow again from there.
+  const int truncs[] = { 19850, 12000, 300, 0 };
+  for (int t = 0; t < 4; t++) {
+    store.Truncate(truncs[t]);
+    while (!movenums.empty() && movenums.back() > truncs[t]) {
+      movenums.pop_back();
+      expected.pop_back();
+    }
+    CheckAll(&store, expected, movenums);
+
+    for (int i = 0; i < 50; i++) {
+      NextState(&rc, &state);
+      const int movenum = movenums.back() + 1 + rc.Byte();
+      store.Push(movenum, state);
+      expected.push_back(state);
+      movenums.push_back(movenum);
+    }
+    CheckAll(&store, expected, movenums);
+  }
+
+  store.PrintStats();
+  fprintf(stderr, "OK.\n");
+  return 0;
+}
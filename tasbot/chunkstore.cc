@@ -0,0 +1,91 @@
+#include "chunkstore.h"
+
+#include <string.h>
+
+#include "../cc-lib/city/city.h"
+
+// Approximate bytes of bookkeeping per distinct chunk: the Chunk,
+// the hash table node, and malloc's own overhead.
+static const uint64 CHUNK_OVERHEAD = 80;
+
+ChunkStore::ChunkStore() : statesize(0), bytes(0ULL) {}
+
+ChunkStore::~ChunkStore() {
+  Clear();
+}
+
+void ChunkStore::Clear() {
+  for (int i = 0; i < chunks.size(); i++)
+    delete[] chunks[i].data;
+  chunks.clear();
+  freelist.clear();
+  byhash.clear();
+  bytes = 0ULL;
+}
+
+void ChunkStore::Reset(const vector<uint32> &s, uint32 size) {
+  CHECK(!s.empty() && s[0] == 0);
+  for (int i = 1; i < s.size(); i++) CHECK(s[i - 1] < s[i]);
+  CHECK(s.back() < size);
+  Clear();
+  starts = s;
+  statesize = size;
+}
+
+void ChunkStore::Put(const uint8 *state, Handle *handles) {
+  for (int i = 0; i < starts.size(); i++) {
+    const uint8 *p = state + starts[i];
+    const uint32 size =
+      (i + 1 < starts.size() ? starts[i + 1] : statesize) - starts[i];
+    const uint64 hash = CityHash64((const char *)p, size);
+
+    unordered_map<uint64, Handle>::iterator it = byhash.find(hash);
+    if (it != byhash.end()) {
+      Chunk *c = &chunks[it->second];
+      if (c->size == size && 0 == memcmp(c->data, p, size)) {
+        c->refs++;
+        handles[i] = it->second;
+        continue;
+      }
+    }
+
+    Handle h;
+    if (freelist.empty()) {
+      h = chunks.size();
+      chunks.push_back(Chunk());
+    } else {
+      h = freelist.back();
+      freelist.pop_back();
+    }
+    Chunk *c = &chunks[h];
+    c->hash = hash;
+    c->data = new uint8[size];
+    memcpy(c->data, p, size);
+    c->size = size;
+    c->refs = 1;
+    if (it == byhash.end()) byhash[hash] = h;
+    bytes += size + CHUNK_OVERHEAD;
+    handles[i] = h;
+  }
+}
+
+void ChunkStore::Get(const Handle *handles, uint8 *state) const {
+  for (int i = 0; i < starts.size(); i++) {
+    const Chunk &c = chunks[handles[i]];
+    memcpy(state + starts[i], c.data, c.size);
+  }
+}
+
+void ChunkStore::Release(const Handle *handles) {
+  for (int i = 0; i < starts.size(); i++) {
+    Chunk *c = &chunks[handles[i]];
+    CHECK(c->refs > 0);
+    if (--c->refs > 0) continue;
+    unordered_map<uint64, Handle>::iterator it = byhash.find(c->hash);
+    if (it != byhash.end() && it->second == handles[i]) byhash.erase(it);
+    bytes -= c->size + CHUNK_OVERHEAD;
+    delete[] c->data;
+    c->data = NULL;
+    freelist.push_back(handles[i]);
+  }
+}
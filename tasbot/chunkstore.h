@@ -0,0 +1,65 @@
+/* Content-addressed storage for uncompressed savestates.
+
+   Neighboring states are mostly the same. Nametables, palette,
+   CHR-RAM, WRAM and sound registers rarely change from one frame to
+   the next, and most pages of RAM don't either. So each state is cut
+   into chunks at fixed offsets (see FCEUSS_FlatChunks), every
+   distinct chunk is stored once with a reference count, and a
+   state is just the handles of its chunks. */
+
+#ifndef __TASBOT_CHUNKSTORE_H
+#define __TASBOT_CHUNKSTORE_H
+
+#include <unordered_map>
+#include <vector>
+
+#include "tasbot.h"
+
+struct ChunkStore {
+  typedef uint32 Handle;
+
+  ChunkStore();
+  ~ChunkStore();
+
+  // Sets where chunks start in states of the given size (the first
+  // at 0, then increasing), and empties the store.
+  void Reset(const vector<uint32> &starts, uint32 statesize);
+
+  int NumChunks() const { return starts.size(); }
+  uint32 StateSize() const { return statesize; }
+
+  // Stores a state of StateSize() bytes, writing NumChunks() handles.
+  // Each one holds a reference until passed to Release.
+  void Put(const uint8 *state, Handle *handles);
+  // Reassembles the state.
+  void Get(const Handle *handles, uint8 *state) const;
+  void Release(const Handle *handles);
+
+  // Memory used by the distinct chunks, including bookkeeping.
+  uint64 Bytes() const { return bytes; }
+  uint64 NumDistinct() const { return chunks.size() - freelist.size(); }
+
+  // Frees every chunk, leaving the layout alone. Outstanding handles
+  // become invalid.
+  void Clear();
+
+ private:
+  struct Chunk {
+    uint64 hash;
+    uint8 *data;
+    uint32 size;
+    // Zero for a free Chunk.
+    uint32 refs;
+  };
+
+  vector<uint32> starts;
+  uint32 statesize;
+  vector<Chunk> chunks;
+  vector<Handle> freelist;
+  // Chunks by content hash. If two different chunks collide, only
+  // the first is found here, and the second just isn't shared.
+  unordered_map<uint64, Handle> byhash;
+  uint64 bytes;
+};
+
+#endif
@@ -6,10 +6,13 @@
 
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <chrono>
 
 #include "fceu/utils/md5.h"
 
@@ -137,6 +140,31 @@ int main(int argc, char *argv[]) {
     return -1;
   }
 
+  fprintf(stderr, "\nTest headless PPU against full rendering:\n");
+  // Step doesn't draw pixels and fast-forwards idle loops, neither
+  // of which may change anything the game can see. Replay the movie
+  // with both turned off and check that every frame produces the
+  // same state.
+  Emulator::PrintCoreStats();
+  FCEUI_SetHeadlessPPU(false);
+  FCEUI_SetIdleLoopSkip(false);
+  Emulator::Load(&beginning);
+  for (int i = 0; i < inputs.size(); i++) {
+    Emulator::Step(inputs[i]);
+    if (i + 1 < savestates.size()) {
+      vector<uint8> res;
+      Emulator::SaveEx(&res, &basis);
+      if (res != savestates[i + 1]) {
+	fprintf(stderr, "Full emulation differs from Step after "
+		"frame %d.\n", i);
+	abort();
+      }
+    }
+  }
+  FCEUI_SetHeadlessPPU(true);
+  FCEUI_SetIdleLoopSkip(true);
+  fprintf(stderr, "Full emulation matches.\n");
+
   fprintf(stderr, "\nTest random replay of savestates:\n");
   // Now run through each state in random order. Load it, then execute a step,
   // then check that we get to the same state as before.
@@ -168,7 +196,7 @@ int main(int argc, char *argv[]) {
 	  ss_total / (double)savestates.size());
 
   // Again with caching.
-  Emulator::ResetCache(100, 10);
+  Emulator::ResetCache(100 * 16384);
 
   for (int i = 0; i < order.size(); i++) {
     int idx = i;
@@ -209,6 +237,334 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  // Uncompressed states use the flat layout, which must restore
+  // exactly what the tagged format does.
+  for (int frame = 0; frame < savestates.size(); frame += 97) {
+    Emulator::LoadEx(&savestates[frame], &basis);
+    vector<uint8> flat;
+    Emulator::SaveUncompressed(&flat);
+    CHECK(FCEUSS_IsFlat(&flat));
+    Emulator::Load(&beginning);
+    Emulator::LoadUncompressed(&flat);
+    vector<uint8> res;
+    Emulator::SaveEx(&res, &basis);
+    if (res != savestates[frame]) {
+      fprintf(stderr, "Flat savestate differs at frame %d.\n", frame);
+      abort();
+    }
+  }
+  // And it still takes tagged ones.
+  Emulator::LoadUncompressed(&basis);
+  fprintf(stderr, "Flat savestates are ok.\n");
+
+  // The search profile has to play the whole movie the same way, and
+  // make smaller states.
+  {
+    Emulator::Load(&beginning);
+    vector<uint8> full, search;
+    Emulator::SaveUncompressed(&full);
+    Emulator::SetProfile(Emulator::PROFILE_SEARCH);
+    Emulator::SaveUncompressed(&search);
+    Emulator::SetProfile(Emulator::PROFILE_FULL);
+    fprintf(stderr, "Flat states are %d bytes, %d in the search profile.\n",
+	    (int)full.size(), (int)search.size());
+    CHECK(search.size() < full.size());
+    CHECK(Emulator::VerifyProfile(Emulator::PROFILE_SEARCH, inputs) == -1);
+  }
+  fprintf(stderr, "Profiles are ok.\n");
+
+  // Every codec gives back exactly the state it was given, with the
+  // tagged basis, a flat one, or none. Loading works whatever codec
+  // is set.
+  {
+    vector<uint8> flatbasis;
+    Emulator::SaveUncompressed(&flatbasis);
+    const vector<uint8> *bases[] = { &basis, &flatbasis, NULL };
+    const Emulator::Codec codecs[] = {
+      Emulator::CODEC_ZLIB, Emulator::CODEC_FAST,
+    };
+    for (int frame = 0; frame < savestates.size(); frame += 61) {
+      Emulator::LoadEx(&savestates[frame], &basis);
+      vector<uint8> expected;
+      Emulator::SaveUncompressed(&expected);
+      for (int c = 0; c < 2; c++) {
+	for (int b = 0; b < 3; b++) {
+	  Emulator::SetCodec(codecs[c], c == 0 ? 1 : -1);
+	  vector<uint8> enc;
+	  Emulator::SaveEx(&enc, bases[b]);
+	  Emulator::SetCodec(Emulator::CODEC_ZLIB, -1);
+	  Emulator::Load(&beginning);
+	  Emulator::LoadEx(&enc, bases[b]);
+	  vector<uint8> res;
+	  Emulator::SaveUncompressed(&res);
+	  if (res != expected) {
+	    fprintf(stderr, "Codec %d with basis %d differs at frame %d.\n",
+		    c, b, frame);
+	    abort();
+	  }
+	}
+      }
+    }
+  }
+  fprintf(stderr, "Codecs are ok.\n");
+
+  // RestoreBase only copies back what was written, so run a few
+  // different futures from each base and make sure it's all undone.
+  for (int frame = 0; frame < savestates.size(); frame += 89) {
+    Emulator::LoadEx(&savestates[frame], &basis);
+    Emulator::MarkBase();
+    for (int f = 0; f < 3; f++) {
+      for (int i = 0; i < 20 * f; i++)
+	Emulator::Step(inputs[(frame + i * 7) % inputs.size()]);
+      Emulator::RestoreBase();
+      vector<uint8> res;
+      Emulator::SaveEx(&res, &basis);
+      if (res != savestates[frame]) {
+	fprintf(stderr, "RestoreBase differs at frame %d (future %d).\n",
+		frame, f);
+	abort();
+      }
+    }
+  }
+  fprintf(stderr, "RestoreBase is ok.\n");
+
+  // A fingerprint kept up incrementally while stepping (and through
+  // RestoreBase) has to match one computed from scratch after a load,
+  // and different states should get different ones.
+  {
+    uint128 last(0ULL, 0ULL);
+    vector<uint8> flat;
+    Emulator::LoadEx(&savestates[0], &basis);
+    Emulator::MarkBase();
+    for (int frame = 0; frame < savestates.size(); frame++) {
+      if (frame % 71 == 0) {
+	Emulator::RestoreBase();
+	Emulator::LoadEx(&savestates[frame], &basis);
+      }
+      const uint128 incremental = Emulator::StateFingerprint();
+      Emulator::SaveUncompressed(&flat);
+      Emulator::LoadUncompressed(&flat);
+      if (incremental != Emulator::StateFingerprint()) {
+	fprintf(stderr, "Fingerprint is stale at frame %d.\n", frame);
+	abort();
+      }
+      if (frame > 0 && savestates[frame] != savestates[frame - 1]) {
+	CHECK(incremental != last);
+      }
+      last = incremental;
+      Emulator::Step(inputs[frame]);
+    }
+  }
+  fprintf(stderr, "Fingerprints are ok.\n");
+
+  // Every byte of RAM that a step changes has to be in the bitmap,
+  // stepping or from the cache.
+  Emulator::ResetCache(1000 * 16384);
+  for (int pass = 0; pass < 2; pass++) {
+    for (int frame = 0; frame < savestates.size(); frame += 53) {
+      Emulator::LoadEx(&savestates[frame], &basis);
+      vector<uint8> before, after;
+      Emulator::GetMemory(&before);
+      Emulator::CachingStep(inputs[frame]);
+      Emulator::GetMemory(&after);
+      const uint8 *changed = Emulator::GetChangedBits();
+      for (int i = 0; i < 0x800; i++) {
+	const uint8 bit = 1 << (i & 7);
+	if (before[i] != after[i] && !(changed[i >> 3] & bit)) {
+	  fprintf(stderr, "RAM %d changed at frame %d but isn't marked "
+		  "(pass %d).\n", i, frame, pass);
+	  abort();
+	}
+      }
+    }
+  }
+  fprintf(stderr, "RAM change bitmaps are ok.\n");
+
+  // The cache stores results under just the joypad bits the frame
+  // read, so a different input can hit. It must still give exactly
+  // the state that really stepping with that input does.
+  Emulator::ResetCache(1000 * 16384);
+  for (int frame = 0; frame < savestates.size(); frame += 41) {
+    for (int k = 0; k < 4; k++) {
+      const uint8 input = (inputs[frame] * 37 + k * 91) & 255;
+      Emulator::LoadEx(&savestates[frame], &basis);
+      Emulator::Step(input);
+      vector<uint8> expected;
+      Emulator::SaveEx(&expected, &basis);
+
+      Emulator::LoadEx(&savestates[frame], &basis);
+      Emulator::CachingStep(input);
+      vector<uint8> res;
+      Emulator::SaveEx(&res, &basis);
+      if (res != expected) {
+	fprintf(stderr, "Cached step with input %02x differs at frame %d.\n",
+		input, frame);
+	abort();
+      }
+    }
+  }
+  Emulator::PrintCacheStats();
+  fprintf(stderr, "Input-masked cache is ok.\n");
+
+  // Sequences that share a prefix (like a mutant future and its
+  // parent) skip it with the sequence cache, and must end up in the
+  // same state with the same RAM along the way as plain steps. The
+  // changed bits have to cover every byte that differs from the
+  // previous step, skipped or not.
+  for (int frame = 0; frame + 200 < savestates.size(); frame += 503) {
+    for (int k = 0; k < 6; k++) {
+      vector<uint8> seq(inputs.begin() + frame,
+			inputs.begin() + frame + 40 + (k % 3) * 35);
+      for (int i = seq.size() / 2; k >= 3 && i < seq.size(); i++)
+	seq[i] = (seq[i] * 37 + k * 91) & 255;
+
+      Emulator::LoadEx(&savestates[frame], &basis);
+      vector< vector<uint8> > expected_mem(seq.size());
+      for (int i = 0; i < seq.size(); i++) {
+	Emulator::Step(seq[i]);
+	Emulator::GetMemory(&expected_mem[i]);
+      }
+      vector<uint8> expected;
+      Emulator::SaveEx(&expected, &basis);
+
+      Emulator::LoadEx(&savestates[frame], &basis);
+      vector<uint8> prev;
+      Emulator::GetMemory(&prev);
+      vector< vector<uint8> > mem, changed;
+      Emulator::CachingSteps(seq, &mem, &changed);
+      vector<uint8> res;
+      Emulator::SaveEx(&res, &basis);
+      if (res != expected || mem != expected_mem) {
+	fprintf(stderr, "Sequence %d from frame %d differs.\n", k, frame);
+	abort();
+      }
+      for (int i = 0; i < seq.size(); i++) {
+	CHECK(changed[i].size() == 0x800 >> 3);
+	for (int j = 0; j < 0x800; j++) {
+	  if (prev[j] != mem[i][j] && !(changed[i][j >> 3] & (1 << (j & 7)))) {
+	    fprintf(stderr, "Sequence %d from frame %d: RAM %d changed at "
+		    "step %d but isn't marked.\n", k, frame, j, i);
+	    abort();
+	  }
+	}
+	prev = mem[i];
+      }
+    }
+  }
+  Emulator::PrintCacheStats();
+  fprintf(stderr, "Sequence cache is ok.\n");
+
+  // The archive has to give the same states, even once the in-memory
+  // caches have forgotten them (as after a restart).
+  {
+    const string archive = StringPrintf("emu_test-%d", (int)getpid());
+    Emulator::OpenArchive(archive, 256 << 20);
+    for (int pass = 0; pass < 2; pass++) {
+      Emulator::ResetCache(1000 * 16384);
+      for (int frame = 0; frame + 100 < savestates.size(); frame += 701) {
+	vector<uint8> seq(inputs.begin() + frame,
+			  inputs.begin() + frame + 30 + frame % 50);
+	Emulator::LoadEx(&savestates[frame], &basis);
+	for (int i = 0; i < seq.size(); i++) Emulator::Step(seq[i]);
+	vector<uint8> expected;
+	Emulator::SaveEx(&expected, &basis);
+
+	Emulator::LoadEx(&savestates[frame], &basis);
+	Emulator::CachingSteps(seq, NULL, NULL);
+	vector<uint8> res;
+	Emulator::SaveEx(&res, &basis);
+	if (res != expected) {
+	  fprintf(stderr, "Archived sequence from frame %d differs "
+		  "(pass %d).\n", frame, pass);
+	  abort();
+	}
+      }
+    }
+    Emulator::PrintCacheStats();
+    // Still mapped, so it keeps working for the rest of the test.
+    unlink((archive + ".states").c_str());
+    unlink((archive + ".index").c_str());
+  }
+  fprintf(stderr, "Archive is ok.\n");
+
+  // Steps run by another process come out of the shared cache, and
+  // have to be the same as running them.
+  {
+    const string shared = StringPrintf("emu_test-%d", (int)getpid());
+    Emulator::OpenSharedCache(shared, 64 << 20);
+    for (int pass = 0; pass < 2; pass++) {
+      const pid_t child = pass == 0 ? fork() : 0;
+      if (pass == 0 && child > 0) {
+	int status = 0;
+	CHECK(waitpid(child, &status, 0) == child);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	continue;
+      }
+      Emulator::ResetCache(1000 * 16384);
+      for (int frame = 0; frame + 1 < savestates.size(); frame += 13) {
+	const uint8 input = (frame & 1) ? inputs[frame] : inputs[frame] ^ 0x0F;
+	Emulator::LoadEx(&savestates[frame], &basis);
+	Emulator::Step(input);
+	vector<uint8> expected;
+	Emulator::SaveEx(&expected, &basis);
+
+	Emulator::LoadEx(&savestates[frame], &basis);
+	Emulator::CachingStep(input);
+	vector<uint8> res;
+	Emulator::SaveEx(&res, &basis);
+	if (res != expected) {
+	  fprintf(stderr, "Shared cache step differs at frame %d "
+		  "(pass %d).\n", frame, pass);
+	  abort();
+	}
+      }
+      Emulator::PrintCacheStats();
+      if (pass == 0) {
+	fflush(stdout);
+	_exit(0);
+      }
+    }
+    // Still mapped, so it keeps working for the rest of the test.
+    shm_unlink(("/" + shared).c_str());
+  }
+  fprintf(stderr, "Shared cache is ok.\n");
+
+  // State handles along the whole movie, first with plenty of memory
+  // and then with little enough that most have to be replayed.
+  for (uint64 budget : { 256ULL << 20, 256ULL << 10 }) {
+    StateHandle::SetBudget(budget);
+    vector<StateHandle> handles;
+    Emulator::LoadEx(&savestates[0], &basis);
+    handles.push_back(StateHandle::Save());
+    for (int i = 0; i + 1 < savestates.size(); i++) {
+      Emulator::Step(inputs[i]);
+      handles.push_back(handles.back().After(inputs[i]));
+    }
+
+    int most_replayed = 0;
+    for (int i = 0; i < handles.size(); i += 97) {
+      handles[i].Load();
+      vector<uint8> res;
+      Emulator::SaveEx(&res, &basis);
+      if (res != savestates[i]) {
+	fprintf(stderr, "State handle for frame %d differs.\n", i);
+	abort();
+      }
+      most_replayed = max(most_replayed, handles[i].Replay());
+    }
+    StateHandle::PrintStats();
+    if (budget < (1ULL << 20) && most_replayed < 2) {
+      fprintf(stderr, "Small budget should have made handles replay.\n");
+      abort();
+    }
+    // Even with no memory pressure, k is more than 1.
+    if (budget > (1ULL << 20) && most_replayed < 1) {
+      fprintf(stderr, "Handles should replay without memory pressure.\n");
+      abort();
+    }
+  }
+  fprintf(stderr, "State handles are ok.\n");
+
   fprintf(stderr, "\nTiming tests.\n");
 
   Emulator::Load(&beginning);
@@ -226,8 +582,59 @@ int main(int argc, char *argv[]) {
 	    cxsum);
   }
 
+  // Savestate codecs, on states from the movie with the basis from
+  // above: average size, and time to save and load.
+  {
+    vector< vector<uint8> > states;
+    for (int frame = 0; frame < savestates.size(); frame += 10) {
+      Emulator::LoadEx(&savestates[frame], &basis);
+      states.push_back(vector<uint8>());
+      Emulator::SaveUncompressed(&states.back());
+    }
+
+    struct Config {
+      const char *name;
+      Emulator::Codec codec;
+      int level;
+    };
+    const Config configs[] = {
+      { "zlib 1", Emulator::CODEC_ZLIB, 1 },
+      { "zlib 6", Emulator::CODEC_ZLIB, 6 },
+      { "fast", Emulator::CODEC_FAST, -1 },
+    };
+    using Clock = std::chrono::steady_clock;
+    for (const Config &config : configs) {
+      Emulator::SetCodec(config.codec, config.level);
+      vector< vector<uint8> > encoded(states.size());
+      uint64 bytes = 0;
+      double save_sec = 0.0;
+      for (int i = 0; i < states.size(); i++) {
+	Emulator::LoadUncompressed(&states[i]);
+	const Clock::time_point start = Clock::now();
+	Emulator::SaveEx(&encoded[i], &basis);
+	save_sec +=
+	  std::chrono::duration<double>(Clock::now() - start).count();
+	bytes += encoded[i].size();
+      }
+
+      const Clock::time_point start = Clock::now();
+      for (int i = 0; i < encoded.size(); i++)
+	Emulator::LoadEx(&encoded[i], &basis);
+      const double load_sec =
+	std::chrono::duration<double>(Clock::now() - start).count();
+
+      fprintf(stderr, "Codec %s: %.1f bytes per state (%.1fx smaller "
+	      "than flat), %.2f us per save, %.2f us per load\n",
+	      config.name, bytes / (double)states.size(),
+	      (states[0].size() * (double)states.size()) / bytes,
+	      1e6 * save_sec / states.size(),
+	      1e6 * load_sec / states.size());
+    }
+    Emulator::SetCodec(Emulator::CODEC_ZLIB, -1);
+  }
+
   Emulator::Load(&beginning);
-  Emulator::ResetCache(50000, 10);
+  Emulator::ResetCache(50000ULL * 16384);
   {
     uint64 cxsum = 0x0;
     Timer steps;
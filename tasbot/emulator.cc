@@ -2,6 +2,8 @@
 #include "emulator.h"
 
 #include <algorithm>
+#include <chrono>
+#include <memory>
 #include <string>
 #include <vector>
 #include <zlib.h>
@@ -14,8 +16,12 @@
 #include "fceu/version.h"
 #include "fceu/state.h"
 #include "fceu/sound.h"
+#include "fceu/x6502.h"
 
 #include "tasbot.h"
+#include "chunkstore.h"
+#include "archive.h"
+#include "sharedcache.h"
 #include "../cc-lib/city/city.h"
 
 // XXX move to header, enable _debug mode.
@@ -28,160 +34,553 @@
 // the "API".
 static uint32 joydata = 0;
 static bool initialized = false;
+static string loaded_romfile;
 
 // The current contents of the screen; part of the "API".
 extern uint8 *XBuf, *XBackBuf;
 
+// Remembers the result of stepping from a state with some input.
+// Lots of frames don't read the joypad at all, or only read some of
+// its bits, and then any input that agrees on the bits that were read
+// gives the same result. So results are stored with the mask of the
+// bits that the frame read and the input masked to those bits, and
+// the cache remembers which masks it has seen for each starting state.
+//
+// Memory use is bounded by a budget in bytes. Result states go in a
+// ChunkStore, since the results of neighboring steps share most of
+// their chunks; each slot holds the handles of one result. Slots are
+// found through an open-addressing (linear probing) index keyed by
+// the starting state's fingerprint, masked input and mask. The
+// starting state itself isn't stored (or even saved); two different
+// keys with the same 128-bit hash are not a practical concern.
+// Eviction is CLOCK: a hit sets the slot's reference bit, and to make
+// room the hand sweeps forward, clearing bits, until it finds a slot
+// without one. Hits, inserts and evictions are all constant time
+// (amortized, for the sweep).
 struct StateCache {
-  // These vectors are allocated with new.
-  // Input and starting state (uncompresed).
-  typedef pair<uint8, const vector<uint8> *> Key;
-  // Sequence number and output state (uncompressed).
-  typedef pair<uint64, vector<uint8> *> Value;
-
-  struct HashFunction {
-    size_t operator ()(const Key &k) const {
-      CHECK(k.second);
-      return CityHash64WithSeed((const char *)&(k.second->at(0)),
-				k.second->size(),
-				k.first);
-    }
+  static constexpr uint32 NONE = 0xFFFFFFFF;
+  // Masks remembered per starting state.
+  static constexpr int HINT_MASKS = 4;
+
+  struct Bucket {
+    // Both zero for an empty bucket.
+    uint64 k0, k1;
+    uint32 slot;
   };
 
-  // Use value equality on the vectors, not pointer equality
-  // (which would be the default for ==).
-  struct KeyEquals {
-    size_t operator ()(const Key &l, const Key &r) const {
-      return l.first == r.first &&
-	*l.second == *r.second;
-    }
+  // Direct-mapped and lossy; losing a hint only costs a miss.
+  struct Hint {
+    uint64 state;
+    uint8 num;
+    uint8 masks[HINT_MASKS];
   };
 
-  typedef unordered_map<Key, Value, HashFunction, KeyEquals> Hash;
-
-  StateCache() : limit(0ULL), count(0ULL), next_sequence(0ULL), 
-		 slop(10000ULL), hits(0ULL), misses(0ULL) {
-  }
-
-  void Resize(uint64 ll, uint64 ss) {
-    printf("Resize cache %llu %llu\n",
-           static_cast<unsigned long long>(ll),
-           static_cast<unsigned long long>(ss));
-    // Recover memory.
-    for (Hash::iterator it = hashtable.begin(); 
-	 it != hashtable.end(); /* in loop */) {
-      Hash::iterator next(it);
-      ++next;
-      delete it->first.second;
-      delete it->second.second;
-      hashtable.erase(it);
-      it = next;
+  // Bytes of bookkeeping per slot, in addition to its chunk handles:
+  // two index buckets, a mask hint, the back pointer and the bit.
+  static constexpr uint64 SLOT_OVERHEAD =
+    2 * sizeof (Bucket) + sizeof (Hint) + sizeof (uint64) + sizeof (uint8);
+
+  // Slots are allocated assuming that the chunks only a single result
+  // has take about 1/EXPECTED_SHARING of a state, on average. If it's
+  // more, the budget runs out before the slots do.
+  static constexpr uint32 EXPECTED_SHARING = 8;
+
+  StateCache() : budget(0ULL), statesize(0), capacity(0), used(0),
+		 live(0), hand(0), nchunks(0), fixedbytes(0ULL),
+		 indexmask(0), hintmask(0),
+		 hits(0ULL), misses(0ULL), evictions(0ULL),
+		 masked_hits(0ULL), unread_misses(0ULL) {
+  }
+
+  void Resize(uint64 bytes) {
+    printf("Resize cache to %.1f MB\n", bytes / (1024.0 * 1024.0));
+    budget = bytes;
+    // Allocated once we know the state size.
+    statesize = 0;
+    Clear();
+  }
+
+  void Clear() {
+    store.Clear();
+    handles.reset();
+    index.clear();
+    hints.clear();
+    bucket_of.clear();
+    referenced.clear();
+    freeslots.clear();
+    capacity = used = live = hand = 0;
+    nchunks = 0;
+    fixedbytes = 0ULL;
+    indexmask = hintmask = 0;
+  }
+
+  // Lay out the arrays for states of this size.
+  void Allocate(uint32 size) {
+    Clear();
+    statesize = size;
+    vector<uint32> starts;
+    FCEUSS_FlatChunks(&starts);
+    store.Reset(starts, size);
+    nchunks = store.NumChunks();
+    scratch.resize(size);
+    const uint64 perslot =
+      SLOT_OVERHEAD + nchunks * sizeof (ChunkStore::Handle);
+    capacity = std::min(budget / (perslot + size / EXPECTED_SHARING),
+			(uint64)NONE - 1);
+    if (capacity == 0) return;
+    fixedbytes = capacity * perslot;
+    uint64 buckets = 1;
+    while (buckets < 2 * capacity) buckets <<= 1;
+    indexmask = buckets - 1;
+    // Leave it uninitialized; pages are only touched as slots fill.
+    handles.reset(new ChunkStore::Handle[(uint64)capacity * nchunks]);
+    Bucket empty = { 0ULL, 0ULL, NONE };
+    index.resize(buckets, empty);
+    Hint nohint = { 0ULL, 0, { 0, 0, 0, 0 } };
+    hints.resize(capacity, nohint);
+    hintmask = 1;
+    while (hintmask * 2 <= capacity) hintmask <<= 1;
+    hintmask--;
+    bucket_of.resize(capacity, NONE);
+    referenced.resize(capacity, 0);
+  }
+
+  static void MakeKey(const uint128 &start, uint8 input, uint8 mask,
+		      uint64 *k0, uint64 *k1) {
+    const uint64 v = (uint64)mask << 8 | (uint8)(input & mask);
+    *k0 = Hash128to64(uint128(Uint128Low64(start), v));
+    *k1 = Hash128to64(uint128(Uint128High64(start),
+			      v ^ 0x5555555555555555ULL));
+    if (*k0 == 0ULL && *k1 == 0ULL) *k0 = 1ULL;
+  }
+
+  static bool Empty(const Bucket &b) {
+    return b.k0 == 0ULL && b.k1 == 0ULL;
+  }
+
+  // Bucket holding the key, or the empty bucket where it would go.
+  uint64 Probe(uint64 k0, uint64 k1) const {
+    uint64 i = k0 & indexmask;
+    while (!Empty(index[i]) && (index[i].k0 != k0 || index[i].k1 != k1))
+      i = (i + 1) & indexmask;
+    return i;
+  }
+
+  // Remove the bucket, shifting later members of its probe run back
+  // so that lookups never have to skip over tombstones.
+  void EraseBucket(uint64 i) {
+    uint64 j = i;
+    for (;;) {
+      j = (j + 1) & indexmask;
+      if (Empty(index[j])) break;
+      const uint64 home = index[j].k0 & indexmask;
+      // Can move back to i unless its home is cyclically in (i, j].
+      const bool stays = (i <= j) ? (i < home && home <= j) :
+	(i < home || home <= j);
+      if (!stays) {
+	index[i] = index[j];
+	bucket_of[index[i].slot] = i;
+	i = j;
+      }
     }
-    CHECK(hashtable.size() == 0);
+    index[i].k0 = index[i].k1 = 0ULL;
+    index[i].slot = NONE;
+  }
 
-    limit = ll;
-    slop = ss;
-    CHECK(limit >= 0);
-    CHECK(slop >= 0);
-    next_sequence = count = 0ULL;
-    printf("OK.\n");
+  ChunkStore::Handle *SlotHandles(uint32 slot) {
+    return &handles[(uint64)slot * nchunks];
   }
 
-  // Assumes it's not present. If it is, then you'll leak.
-  void Remember(uint8 input, const vector<uint8> &start,
-		const vector<uint8> &result) {
-    vector<uint8> *startcopy = new vector<uint8>(start),
-                  *resultcopy = new vector<uint8>(result);
-    pair<Hash::iterator, bool> it =
-      hashtable.insert(make_pair(make_pair(input, startcopy), 
-				 make_pair(next_sequence++, resultcopy)));
-    CHECK(it.second);
-    DCHECK(NULL != GetKnownResult(input, *startcopy));
-    DCHECK(NULL != GetKnownResult(input, start));
-    count++;
-    MaybeResize();
-  }
-
-  // Return a pointer to the result state (and update its LRU
-  // sequence) or NULL if it is not known.
-  vector<uint8> *GetKnownResult(uint8 input, const vector<uint8> &start) {
-    Hash::iterator it = hashtable.find(make_pair(input, &start));
-    if (it == hashtable.end()) {
-      misses++;
-      return NULL;
+  uint64 Bytes() const {
+    return fixedbytes + store.Bytes();
+  }
+
+  // Evict the next unreferenced entry other than keep. There must be
+  // one.
+  void EvictOne(uint32 keep) {
+    for (;;) {
+      const uint32 slot = hand;
+      hand = (hand + 1) % used;
+      if (bucket_of[slot] == NONE || slot == keep) continue;
+      if (referenced[slot]) {
+	referenced[slot] = 0;
+	continue;
+      }
+      EraseBucket(bucket_of[slot]);
+      bucket_of[slot] = NONE;
+      store.Release(SlotHandles(slot));
+      freeslots.push_back(slot);
+      live--;
+      evictions++;
+      return;
+    }
+  }
+
+  // Slot to write a new result into, evicting if full.
+  uint32 TakeSlot() {
+    if (freeslots.empty()) {
+      if (used < capacity) return used++;
+      EvictOne(NONE);
     }
+    const uint32 slot = freeslots.back();
+    freeslots.pop_back();
+    return slot;
+  }
 
-    hits++;
-    it->second.first = next_sequence++;
-    return it->second.second;
+  void AddMask(uint64 state, uint8 mask) {
+    Hint *h = &hints[state & hintmask];
+    if (h->state != state || h->num == 0) {
+      h->state = state;
+      h->num = 1;
+      h->masks[0] = mask;
+      return;
+    }
+    for (int i = 0; i < h->num; i++)
+      if (h->masks[i] == mask) return;
+    if (h->num < HINT_MASKS) {
+      h->masks[h->num++] = mask;
+    } else {
+      // Forget the oldest.
+      memmove(h->masks, h->masks + 1, HINT_MASKS - 1);
+      h->masks[HINT_MASKS - 1] = mask;
+    }
   }
 
-  void MaybeResize() {
-    // Don't always do this, since it is linear time.
-    if (count > limit + slop) {
-      const int num_to_remove = count - limit;
-      // printf("Resizing (currently %d) to remove %d\n", count, num_to_remove);
+  // mask is the joypad bits that the step read.
+  // start is the starting state's fingerprint.
+  void Remember(uint8 input, uint8 mask, const uint128 &start,
+		const vector<uint8> &result) {
+    if (mask != 0xFF) unread_misses++;
+    if (result.size() != statesize) Allocate(result.size());
+    if (capacity == 0) return;
+    uint64 k0, k1;
+    MakeKey(start, input, mask, &k0, &k1);
+    uint64 b = Probe(k0, k1);
+    uint32 slot;
+    if (Empty(index[b])) {
+      slot = TakeSlot();
+      // Eviction may have shifted buckets around.
+      b = Probe(k0, k1);
+      index[b].k0 = k0;
+      index[b].k1 = k1;
+      index[b].slot = slot;
+      bucket_of[slot] = b;
+      live++;
+    } else {
+      // Already present; the mask hint must have been lost.
+      slot = index[b].slot;
+      store.Release(SlotHandles(slot));
+    }
+    store.Put(result.data(), SlotHandles(slot));
+    referenced[slot] = 0;
+    AddMask(Uint128Low64(start), mask);
 
-      // PERF: This can be done much more efficiently using a flat
-      // heap.
-      vector<uint64> all_sequences;
-      all_sequences.reserve(count);
+    while (live > 1 && Bytes() > budget) EvictOne(slot);
+  }
 
-      // First pass, get the num_to_remove oldest (lowest) sequences.
-      for (Hash::const_iterator it = hashtable.begin(); 
-	   it != hashtable.end(); ++it) {
-	all_sequences.push_back(it->second.first);
-      }
-      std::sort(all_sequences.begin(), all_sequences.end());
-      
-      CHECK(num_to_remove < all_sequences.size());
-      const uint64 minseq = all_sequences[num_to_remove];
-
-      // printf("Removing everything below %d\n", minseq);
-
-      for (Hash::iterator it = hashtable.begin(); it != hashtable.end(); 
-	   /* in loop */) {
-	if (it->second.first < minseq) {
-	  Hash::iterator next(it);
-	  ++next;
-	  delete it->first.second;
-	  delete it->second.second;
-	  // Note g++ does not return the "next" iterator.
-	  hashtable.erase(it);
-	  count--;
-	  it = next;
-	} else {
-	  ++it;
+  // Return a pointer to the result state (statesize bytes, valid
+  // until the next call) and mark it as recently used, or return
+  // NULL if it is not known. Sets *read to the joypad bits that the
+  // step read.
+  const uint8 *GetKnownResult(uint8 input, const uint128 &start,
+			      uint8 *read) {
+    if (capacity > 0) {
+      const Hint &h = hints[Uint128Low64(start) & hintmask];
+      if (h.state == Uint128Low64(start)) {
+	for (int i = 0; i < h.num; i++) {
+	  const uint8 mask = h.masks[i];
+	  uint64 k0, k1;
+	  MakeKey(start, input, mask, &k0, &k1);
+	  const uint64 b = Probe(k0, k1);
+	  if (!Empty(index[b])) {
+	    hits++;
+	    if (mask != 0xFF) masked_hits++;
+	    const uint32 slot = index[b].slot;
+	    referenced[slot] = 1;
+	    *read = mask;
+	    store.Get(SlotHandles(slot), &scratch[0]);
+	    return &scratch[0];
+	  }
 	}
       }
-      // printf("Size is now %d (internally %d)\n", count, hashtable.size());
     }
+
+    misses++;
+    return NULL;
   }
 
   void PrintStats() {
-    printf("Current cache size: %ld / %ld. next_seq %ld\n"
-	   "%ld hits and %ld misses\n", 
-	   count, limit, next_sequence,
-	   hits, misses);
+    printf("Current cache size: %u / %u states of %u bytes "
+	   "(budget %.1f MB). %llu evictions\n"
+	   "%llu distinct chunks of %d per state, %.1f MB "
+	   "(%.0f bytes per state)\n"
+	   "%llu hits and %llu misses\n"
+	   "%llu hits and %llu misses were on frames that "
+	   "didn't read every button\n",
+	   live, capacity, statesize, budget / (1024.0 * 1024.0),
+	   (unsigned long long)evictions,
+	   (unsigned long long)store.NumDistinct(), nchunks,
+	   store.Bytes() / (1024.0 * 1024.0),
+	   live > 0 ? store.Bytes() / (double)live : 0.0,
+	   (unsigned long long)hits, (unsigned long long)misses,
+	   (unsigned long long)masked_hits,
+	   (unsigned long long)unread_misses);
   }
 
-  Hash hashtable;
-  uint64 limit;
-  uint64 count;
-  uint64 next_sequence;
-  // Number of states I'm allowed to be over my limit before
-  // forcing a GC.
-  uint64 slop;
-
-  uint64 hits, misses;
+  uint64 budget;
+  uint32 statesize;
+  // Number of slots, how many have ever been filled, and how many
+  // are filled now.
+  uint32 capacity, used, live;
+  // The CLOCK hand.
+  uint32 hand;
+  // Chunks per state, and the memory for slots, allocated up front.
+  int nchunks;
+  uint64 fixedbytes;
+  uint64 indexmask, hintmask;
+
+  ChunkStore store;
+  // capacity * nchunks handles.
+  std::unique_ptr<ChunkStore::Handle[]> handles;
+  // Reassembled result state.
+  vector<uint8> scratch;
+  vector<Bucket> index;
+  vector<Hint> hints;
+  // For each slot, the index bucket that points at it.
+  vector<uint64> bucket_of;
+  vector<uint8> referenced;
+  // Slots that were filled and then evicted.
+  vector<uint32> freeslots;
+
+  uint64 hits, misses, evictions;
+  // Hits on entries whose step didn't read every button; without
+  // masking, most of these would have been misses. And the misses
+  // that went on to produce such an entry.
+  uint64 masked_hits, unread_misses;
 };
 static StateCache *cache = NULL;
 
+// Remembers whole input sequences run from a starting state, so that
+// replaying one (or the start of one) doesn't have to look up and
+// load every frame. For each starting fingerprint there's a trie over
+// the inputs; like StateCache, an edge is keyed by the joypad mask
+// that the step read and the input masked to it. Every node keeps the
+// RAM after its step, and some also keep the whole state: where a run
+// ended, and every STATE_EVERY steps along the way. Both go in chunk
+// stores, since consecutive frames share most of their chunks.
+// There's no fine-grained eviction; when it goes over budget, the
+// whole thing is thrown away, since the search has usually moved on.
+struct SequenceCache {
+  static constexpr uint32 NONE = 0xFFFFFFFF;
+  static constexpr int NODE_MASKS = 4;
+  static constexpr int STATE_EVERY = 32;
+  // Approximate bytes for an entry in one of the hash tables.
+  static constexpr uint64 EDGE_OVERHEAD = 48;
+
+  struct Node {
+    uint32 depth;
+    // Offset of the result state's handles in statehandles, or NONE.
+    uint32 state;
+    // The joypad masks that steps from here have read.
+    uint8 nmasks;
+    uint8 masks[NODE_MASKS];
+  };
+
+  SequenceCache() : budget(0ULL), statesize(0), jumps(0ULL),
+		    frames_skipped(0ULL), frames_run(0ULL), resets(0ULL) {}
+
+  void Resize(uint64 bytes) {
+    budget = bytes;
+    statesize = 0;
+    Clear();
+  }
+
+  void Clear() {
+    nodes.clear();
+    ramhandles.clear();
+    changedhandles.clear();
+    statehandles.clear();
+    roots.clear();
+    edges.clear();
+    ramstore.Clear();
+    changedstore.Clear();
+    statestore.Clear();
+  }
+
+  void Allocate(uint32 size) {
+    Clear();
+    statesize = size;
+    vector<uint32> starts;
+    FCEUSS_FlatChunks(&starts);
+    statestore.Reset(starts, size);
+    starts.clear();
+    for (uint32 i = 0; i < 0x800; i += FCEUSS_FLAT_CHUNK)
+      starts.push_back(i);
+    ramstore.Reset(starts, 0x800);
+    changedstore.Reset(vector<uint32>(1, 0), sizeof (RAMChanged));
+  }
+
+  uint64 Bytes() const {
+    return nodes.size() * (sizeof (Node) + EDGE_OVERHEAD +
+			   (ramstore.NumChunks() + 1) *
+			   sizeof (ChunkStore::Handle)) +
+      statehandles.size() * sizeof (ChunkStore::Handle) +
+      ramstore.Bytes() + changedstore.Bytes() + statestore.Bytes();
+  }
+
+  // New node with the current RAM, and the changed bits of the step
+  // that got there (meaningless for a root).
+  uint32 AddNode(uint32 depth) {
+    const uint32 n = nodes.size();
+    Node node;
+    node.depth = depth;
+    node.state = NONE;
+    node.nmasks = 0;
+    nodes.push_back(node);
+    ramhandles.resize(ramhandles.size() + ramstore.NumChunks());
+    ramstore.Put(RAM, &ramhandles[(uint64)n * ramstore.NumChunks()]);
+    changedhandles.resize(n + 1);
+    changedstore.Put(RAMChanged, &changedhandles[n]);
+    return n;
+  }
+
+  // Root for the starting state, which must be the current one.
+  uint32 Root(const uint128 &start) {
+    unordered_map<uint64, pair<uint64, uint32> >::const_iterator it =
+      roots.find(Uint128Low64(start));
+    if (it != roots.end()) {
+      // Another state with the same low half is a practical
+      // impossibility, but just don't share then.
+      return it->second.first == Uint128High64(start) ?
+	it->second.second : NONE;
+    }
+    const uint32 n = AddNode(0);
+    roots[Uint128Low64(start)] = make_pair(Uint128High64(start), n);
+    return n;
+  }
+
+  static uint64 EdgeKey(uint32 node, uint8 input, uint8 mask) {
+    return (uint64)node << 16 | (uint64)mask << 8 | (uint8)(input & mask);
+  }
+
+  uint32 Child(uint32 node, uint8 input) const {
+    const Node &n = nodes[node];
+    for (int i = 0; i < n.nmasks; i++) {
+      unordered_map<uint64, uint32>::const_iterator it =
+	edges.find(EdgeKey(node, input, n.masks[i]));
+      if (it != edges.end()) return it->second;
+    }
+    return NONE;
+  }
+
+  // Child for a step that was just taken with the input and read the
+  // mask, adding it if it's new.
+  uint32 Extend(uint32 node, uint8 input, uint8 mask) {
+    const uint64 key = EdgeKey(node, input, mask);
+    unordered_map<uint64, uint32>::const_iterator it = edges.find(key);
+    if (it != edges.end()) return it->second;
+    const uint32 child = AddNode(nodes[node].depth + 1);
+    edges[key] = child;
+    Node *n = &nodes[node];
+    if (std::find(n->masks, n->masks + n->nmasks, mask) ==
+	n->masks + n->nmasks) {
+      if (n->nmasks < NODE_MASKS) {
+	n->masks[n->nmasks++] = mask;
+      } else {
+	// Forget the oldest; its children just become unreachable.
+	memmove(n->masks, n->masks + 1, NODE_MASKS - 1);
+	n->masks[NODE_MASKS - 1] = mask;
+      }
+    }
+    return child;
+  }
+
+  // Keep the current state as the node's.
+  void SaveState(uint32 node, const vector<uint8> &state) {
+    if (nodes[node].state != NONE) return;
+    nodes[node].state = statehandles.size();
+    statehandles.resize(statehandles.size() + statestore.NumChunks());
+    statestore.Put(state.data(), &statehandles[nodes[node].state]);
+  }
+
+  void GetState(uint32 node, vector<uint8> *state) const {
+    state->resize(statesize);
+    statestore.Get(&statehandles[nodes[node].state], &(*state)[0]);
+  }
+
+  void GetRam(uint32 node, vector<uint8> *mem) const {
+    mem->resize(0x800);
+    ramstore.Get(&ramhandles[(uint64)node * ramstore.NumChunks()],
+		 &(*mem)[0]);
+  }
+
+  void GetChanged(uint32 node, vector<uint8> *changed) const {
+    changed->resize(sizeof (RAMChanged));
+    changedstore.Get(&changedhandles[node], &(*changed)[0]);
+  }
+
+  void MaybeReset() {
+    if (Bytes() > budget) {
+      Clear();
+      resets++;
+    }
+  }
+
+  void PrintStats() {
+    printf("Sequence cache: %zu nodes, %.1f / %.1f MB. %llu resets\n"
+	   "%llu jumps skipped %llu frames; %llu frames run\n",
+	   nodes.size(), Bytes() / (1024.0 * 1024.0),
+	   budget / (1024.0 * 1024.0), (unsigned long long)resets,
+	   (unsigned long long)jumps, (unsigned long long)frames_skipped,
+	   (unsigned long long)frames_run);
+  }
+
+  uint64 budget;
+  uint32 statesize;
+  vector<Node> nodes;
+  // ramstore.NumChunks() per node.
+  vector<ChunkStore::Handle> ramhandles;
+  // One per node; the bitmaps repeat a lot.
+  vector<ChunkStore::Handle> changedhandles;
+  vector<ChunkStore::Handle> statehandles;
+  // Root by the low half of the fingerprint, with the high half.
+  unordered_map<uint64, pair<uint64, uint32> > roots;
+  unordered_map<uint64, uint32> edges;
+  ChunkStore ramstore, changedstore, statestore;
+
+  uint64 jumps, frames_skipped, frames_run, resets;
+};
+static SequenceCache *seqcache = NULL;
+
+// Joypad bits read by the last CachingStep.
+static uint8 last_read_mask = 0xFF;
+
+// Shared by processes and runs; see OpenArchive. Shorter sequences
+// aren't worth a record.
+static StateArchive *archive = NULL;
+static const int ARCHIVE_MIN_INPUTS = 8;
+
+// Shared by the processes on this machine; see OpenSharedCache.
+static SharedCache *shared = NULL;
+
+// Every so many Steps is timed for the StateHandle policy (below).
+static const int TIME_STEP_EVERY = 16;
+static int steps_until_timed = 0;
+static void NoteStepSeconds(double seconds);
+
 void Emulator::GetMemory(vector<uint8> *mem) {
   mem->resize(0x800);
   memcpy(&((*mem)[0]), RAM, 0x800);
 }
 
+const uint8 *Emulator::GetMemoryPtr() {
+  return RAM;
+}
+
+const uint8 *Emulator::GetChangedBits() {
+  return RAMChanged;
+}
+
 uint64 Emulator::RamChecksum() {
   md5_context ctx;
   md5_starts(&ctx);
@@ -271,6 +670,8 @@ bool Emulator::Initialize(const string &romfile) {
   }
 
   cache = new StateCache;
+  seqcache = new SequenceCache;
+  loaded_romfile = romfile;
 
   int error;
 
@@ -366,7 +767,15 @@ void Emulator::Step(uint8 inputs) {
   const int SKIP_VIDEO_AND_SOUND = 2;
 
   // Emulate a single frame.
+  if (--steps_until_timed > 0) {
+    FCEUI_Emulate(NULL, &sound, &ssize, SKIP_VIDEO_AND_SOUND);
+    return;
+  }
+  steps_until_timed = TIME_STEP_EVERY;
+  using Clock = std::chrono::steady_clock;
+  const Clock::time_point start = Clock::now();
   FCEUI_Emulate(NULL, &sound, &ssize, SKIP_VIDEO_AND_SOUND);
+  NoteStepSeconds(std::chrono::duration<double>(Clock::now() - start).count());
 }
 
 void Emulator::StepFull(uint8 inputs) {
@@ -421,29 +830,138 @@ void Emulator::GetBasis(vector<uint8> *out) {
 }
 
 void Emulator::SaveUncompressed(vector<uint8> *out) {
-  FCEUSS_SaveRAW(out);
+  FCEUSS_SaveFlat(out);
 }
 
 void Emulator::LoadUncompressed(vector<uint8> *in) {
-  if (!FCEUSS_LoadRAW(in)) {
+  if (!FCEUSS_LoadFlat(in)) {
     fprintf(stderr, "Couldn't restore from state\n");
     abort();
   }
 }
 
+void Emulator::MarkBase() {
+  CHECK(FCEUSS_MarkBase());
+}
+
+void Emulator::RestoreBase() {
+  if (!FCEUSS_RestoreBase()) {
+    fprintf(stderr, "Couldn't restore base state\n");
+    abort();
+  }
+}
+
+uint128 Emulator::StateFingerprint() {
+  uint64 lo, hi;
+  FCEUSS_Fingerprint(&lo, &hi);
+  return uint128(lo, hi);
+}
+
+void Emulator::SetProfile(Profile profile) {
+  FCEUSS_SetProfile(profile == PROFILE_SEARCH ?
+                    FCEUSS_PROFILE_SEARCH : FCEUSS_PROFILE_FULL);
+}
+
+// What VerifyProfile compares after each frame: RAM, then the CPU
+// registers.
+static const int VERIFY_REGS = 7;
+static void GetVerifyState(vector<uint8> *out) {
+  out->resize(0x800 + VERIFY_REGS);
+  memcpy(&(*out)[0], RAM, 0x800);
+  uint8 *r = &(*out)[0x800];
+  r[0] = X.PC & 0xFF;
+  r[1] = X.PC >> 8;
+  r[2] = X.A;
+  r[3] = X.X;
+  r[4] = X.Y;
+  r[5] = X.S;
+  r[6] = X.P;
+}
+
+int Emulator::VerifyProfile(Profile profile, const vector<uint8> &inputs) {
+  // Tagged states are the same in every profile.
+  vector<uint8> start;
+  CHECK(FCEUSS_SaveRAW(&start));
+  const int old_profile = FCEUSS_GetProfile();
+
+  // Loaded in between frames in the second run. They're from all
+  // over the movie, so fields that aren't restored are wrong.
+  static const int DECOY_EVERY = 61;
+  vector< vector<uint8> > decoys;
+
+  vector< vector<uint8> > expected;
+  SetProfile(PROFILE_FULL);
+  vector<uint8> state;
+  for (int i = 0; i < inputs.size(); i++) {
+    if (i % DECOY_EVERY == 0) {
+      decoys.push_back(vector<uint8>());
+      CHECK(FCEUSS_SaveRAW(&decoys.back()));
+    }
+    Step(inputs[i]);
+    SaveUncompressed(&state);
+    LoadUncompressed(&state);
+    expected.push_back(vector<uint8>());
+    GetVerifyState(&expected.back());
+  }
+
+  SetProfile(profile);
+  CHECK(FCEUSS_LoadRAW(&start));
+  int diverged = -1;
+  vector<uint8> got;
+  for (int i = 0; i < inputs.size() && diverged < 0; i++) {
+    Step(inputs[i]);
+    SaveUncompressed(&state);
+    CHECK(FCEUSS_LoadRAW(&decoys[(i / DECOY_EVERY + decoys.size() / 2) %
+                                 decoys.size()]));
+    LoadUncompressed(&state);
+
+    GetVerifyState(&got);
+    for (int j = 0; j < got.size(); j++) {
+      if (got[j] != expected[i][j]) {
+        static const char *const regs[VERIFY_REGS] =
+          { "PC lo", "PC hi", "A", "X", "Y", "S", "P" };
+        if (j < 0x800) {
+          fprintf(stderr, "Profile %d diverges after frame %d: "
+                  "RAM[0x%03x] is 0x%02x, not 0x%02x.\n",
+                  (int)profile, i, j, got[j], expected[i][j]);
+        } else {
+          fprintf(stderr, "Profile %d diverges after frame %d: "
+                  "%s is 0x%02x, not 0x%02x.\n",
+                  (int)profile, i, regs[j - 0x800],
+                  got[j], expected[i][j]);
+        }
+        diverged = i;
+        break;
+      }
+    }
+  }
+
+  FCEUSS_SetProfile(old_profile);
+  CHECK(FCEUSS_LoadRAW(&start));
+  return diverged;
+}
+
 void Emulator::Load(vector<uint8> *state) {
   LoadEx(state, NULL);
 }
 
-// Compression yields 2x slowdown, but states go from ~80kb to 1.4kb
-// Without screenshot, ~1.3kb and only 40% slowdown
-// XXX External interface now allows client to specify, so maybe just
-// make this a guarantee.
-#define USE_COMPRESSION 1
+// zlib: Compression yields 2x slowdown, but states go from ~80kb to
+// 1.4kb. Without screenshot, ~1.3kb and only 40% slowdown.
+//
+// Encoded states start with a word giving the size of what was
+// encoded, with the codec in the top bits. CODEC_ZLIB is 0, so states
+// from before there was a choice still load.
+static const int CODEC_SHIFT = 28;
+static const uint32 CODEC_SIZE_MASK = (1U << CODEC_SHIFT) - 1;
 
-#if USE_COMPRESSION
+static Emulator::Codec save_codec = Emulator::CODEC_ZLIB;
+static int zlib_level = Z_DEFAULT_COMPRESSION;
 
-void Emulator::SaveEx(vector<uint8> *state, const vector<uint8> *basis) {
+// Reused for decompression, so loading doesn't allocate.
+static vector<uint8> zlib_buffer;
+
+static void ZlibSave(vector<uint8> *state, const vector<uint8> *basis,
+		     uint32 *len) {
   // TODO
   // Saving is not as efficient as we'd like for a pure in-memory operation
   //  - uses tags to tell you what's next, even though we could already know
@@ -460,36 +978,33 @@ void Emulator::SaveEx(vector<uint8> *state, const vector<uint8> *basis) {
   }
 
   // Compress.
-  int len = raw.size();
+  *len = raw.size();
   // worst case compression:
   // zlib says "0.1% larger than sourceLen plus 12 bytes"
-  uLongf comprlen = (len >> 9) + 12 + len;
+  uLongf comprlen = (*len >> 9) + 12 + *len;
 
   // Make sure there is contiguous space. Need room for header too.
   state->resize(4 + comprlen);
 
-  if (Z_OK != compress2(&(*state)[4], &comprlen, &raw[0], len, 
-			Z_DEFAULT_COMPRESSION)) {
+  if (Z_OK != compress2(&(*state)[4], &comprlen, &raw[0], *len,
+			zlib_level)) {
     fprintf(stderr, "Couldn't compress.\n");
     abort();
   }
 
-  *(uint32*)&(*state)[0] = len;
-
   // Trim to what we actually needed.
   // PERF: This almost certainly does not actually free the memory. 
   // Might need to copy.
   state->resize(4 + comprlen);
 }
 
-void Emulator::LoadEx(vector<uint8> *state, const vector<uint8> *basis) {
-  // Decompress. First word tells us the decompressed size.
-  int uncomprlen = *(uint32*)&(*state)[0];
-  vector<uint8> uncompressed;
-  uncompressed.resize(uncomprlen);
- 
-  switch (uncompress(&uncompressed[0], (uLongf*)&uncomprlen,
-		     &(*state)[4], state->size() - 4)) {
+static void ZlibLoad(const vector<uint8> &state, uint32 len,
+		     const vector<uint8> *basis) {
+  uLongf uncomprlen = len;
+  zlib_buffer.resize(uncomprlen);
+
+  switch (uncompress(&zlib_buffer[0], &uncomprlen,
+		     &state[4], state.size() - 4)) {
   case Z_OK: break;
   case Z_BUF_ERROR:
     fprintf(stderr, "Not enough room in output\n");
@@ -504,67 +1019,469 @@ void Emulator::LoadEx(vector<uint8> *state, const vector<uint8> *basis) {
     abort();
     break;
   }
-  // fprintf(stderr, "After uncompression: %d\n", uncomprlen);
-  
-  // Why doesn't this equal the result from before?
-  uncompressed.resize(uncomprlen);
+  zlib_buffer.resize(uncomprlen);
 
   // Decode.
-  int blen = (basis == NULL) ? 0 : (min(basis->size(), uncompressed.size()));
+  int blen = (basis == NULL) ? 0 : (min(basis->size(), zlib_buffer.size()));
   for (int i = 0; i < blen; i++) {
-    uncompressed[i] += (*basis)[i];
+    zlib_buffer[i] += (*basis)[i];
   }
 
-  if (!FCEUSS_LoadRAW(&uncompressed)) {
+  if (!FCEUSS_LoadRAW(&zlib_buffer)) {
     fprintf(stderr, "Couldn't restore from state\n");
     abort();
   }
 }
 
-#else
+// The fast codec works on the flat layout, so it wants a flat basis,
+// but bases from GetBasis use the tagged one. This is the flat
+// version of the last such basis, found by content since callers
+// tend to use the same one for the whole run.
+static vector<uint8> flat_basis;
+static uint64 flat_basis_hash = 0ULL;
+
+static const vector<uint8> *FlatBasis(const vector<uint8> *basis) {
+  if (basis == NULL || basis->empty() || FCEUSS_IsFlat(basis))
+    return basis;
+
+  const uint64 h = CityHash64((const char *)&(*basis)[0], basis->size());
+  if (h != flat_basis_hash || !FCEUSS_IsFlat(&flat_basis)) {
+    // Convert by loading it, then put back the real state.
+    vector<uint8> current, raw = *basis;
+    FCEUSS_SaveFlat(&current);
+    if (!FCEUSS_LoadRAW(&raw)) {
+      fprintf(stderr, "Basis isn't a savestate\n");
+      abort();
+    }
+    FCEUSS_SaveFlat(&flat_basis);
+    CHECK(FCEUSS_LoadFlat(&current));
+    flat_basis_hash = h;
+  }
+  return &flat_basis;
+}
 
-// When compression is disabled, we ignore the basis (no point) and
-// don't store any size header. These functions become very simple.
-void Emulator::SaveEx(vector<uint8> *state, const vector<uint8> *basis) {
-  FCEUSS_SaveRAW(out);
+static void FastSave(vector<uint8> *state, const vector<uint8> *basis,
+		     uint32 *len) {
+  basis = FlatBasis(basis);
+  state->resize(4);
+  if (!FCEUSS_SaveFlatDelta(state,
+			    basis == NULL ? NULL : &(*basis)[0],
+			    basis == NULL ? 0 : basis->size())) {
+    fprintf(stderr, "Couldn't save state\n");
+    abort();
+  }
+  // Not needed to decode; just a sanity check.
+  *len = FCEUSS_FlatSize();
 }
 
-void Emulator::LoadEx(vector<uint8> *state, const vector<uint8> *basis) {
-  if (!FCEUSS_LoadRAW(state)) {
+static void FastLoad(const vector<uint8> &state, uint32 len,
+		     const vector<uint8> *basis) {
+  basis = FlatBasis(basis);
+  if (len != FCEUSS_FlatSize() ||
+      !FCEUSS_LoadFlatDelta(&state[4], state.size() - 4,
+			    basis == NULL ? NULL : &(*basis)[0],
+			    basis == NULL ? 0 : basis->size())) {
     fprintf(stderr, "Couldn't restore from state\n");
     abort();
   }
 }
 
+namespace {
+struct StateCodec {
+  // Fills in the state after the header word and sets the size for it.
+  void (*save)(vector<uint8> *state, const vector<uint8> *basis,
+	       uint32 *len);
+  void (*load)(const vector<uint8> &state, uint32 len,
+	       const vector<uint8> *basis);
+};
+}
 
-#endif
+// Indexed by Emulator::Codec.
+static const StateCodec codecs[] = {
+  { ZlibSave, ZlibLoad },
+  { FastSave, FastLoad },
+};
+static const int NUM_CODECS = sizeof (codecs) / sizeof (codecs[0]);
+
+void Emulator::SetCodec(Codec codec, int level) {
+  CHECK(codec >= 0 && codec < NUM_CODECS);
+  CHECK(level == Z_DEFAULT_COMPRESSION || (level >= 1 && level <= 9));
+  save_codec = codec;
+  zlib_level = level;
+}
+
+void Emulator::SaveEx(vector<uint8> *state, const vector<uint8> *basis) {
+  uint32 len = 0;
+  codecs[save_codec].save(state, basis, &len);
+  CHECK(len <= CODEC_SIZE_MASK);
+  *(uint32*)&(*state)[0] = ((uint32)save_codec << CODEC_SHIFT) | len;
+}
+
+void Emulator::LoadEx(vector<uint8> *state, const vector<uint8> *basis) {
+  CHECK(state->size() >= 4);
+  const uint32 header = *(uint32*)&(*state)[0];
+  const uint32 codec = header >> CODEC_SHIFT;
+  if (codec >= NUM_CODECS) {
+    fprintf(stderr, "Unknown state codec %u\n", codec);
+    abort();
+  }
+  codecs[codec].load(*state, header & CODEC_SIZE_MASK, basis);
+}
 
 // Cache stuff.
 
 // static
-void Emulator::ResetCache(uint64 numstates, uint64 slop) {
+void Emulator::ResetCache(uint64 bytes) {
   CHECK(cache != NULL);
-  cache->Resize(numstates, slop);
+  CHECK(seqcache != NULL);
+  cache->Resize(bytes - bytes / 4);
+  seqcache->Resize(bytes / 4);
 }
 
+// Loads the result of a step from a cache instead of running it.
+static void LoadCachedResult(const uint8 *state, uint32 size, uint8 input) {
+  // Didn't run the frame, so recover the changed bits by comparison.
+  uint8 before[0x800];
+  memcpy(before, RAM, 0x800);
+  if (!FCEUSS_LoadFlatMem(state, size)) {
+    fprintf(stderr, "Couldn't restore from cached state\n");
+    abort();
+  }
+  // Eight bytes of RAM are one byte of bits, and most are the same.
+  for (int i = 0; i < 0x800; i += 8) {
+    uint8 bits = 0;
+    if (memcmp(before + i, RAM + i, 8) != 0) {
+      for (int j = 0; j < 8; j++)
+	if (before[i + j] != RAM[i + j]) bits |= 1 << j;
+    }
+    RAMChanged[i >> 3] = bits;
+  }
+  // The cached step may have had different input in the bits that
+  // weren't read, and the joypad bytes are part of the state.
+  joydata = (uint32) input;
+  FCEUI_RefreshJoyState();
+}
+
+// Masks tried in the shared cache, which has no hints: frames mostly
+// read every button or (lag frames) none.
+static const uint8 SHARED_MASKS[] = { 0xFF, 0x00 };
+
 // static
 void Emulator::CachingStep(uint8 input) {
-  vector<uint8> start;
-  SaveUncompressed(&start);
-  if (vector<uint8> *cached = cache->GetKnownResult(input, start)) {
-    LoadUncompressed(cached);
-  } else {
-    Step(input);
-    vector<uint8> result;
-    SaveUncompressed(&result);
-    cache->Remember(input, start, result);
+  const uint128 start = StateFingerprint();
+  if (const uint8 *cached =
+      cache->GetKnownResult(input, start, &last_read_mask)) {
+    LoadCachedResult(cached, cache->statesize, input);
+    return;
+  }
+
+  // Entries in the shared cache are coded against the starting state,
+  // which makes them a few hundred bytes.
+  vector<uint8> before;
+  if (shared != NULL) {
+    SaveUncompressed(&before);
+    for (uint8 mask : SHARED_MASKS) {
+      uint64 k0, k1;
+      StateCache::MakeKey(start, input, mask, &k0, &k1);
+      const uint8 *coded;
+      uint32 size;
+      vector<uint8> result;
+      if (shared->Find(k0, k1, &coded, &size) &&
+	  FCEUSS_DecodeDelta(coded, size, &before[0], before.size(),
+			     &result) &&
+	  result.size() == before.size()) {
+	LoadCachedResult(&result[0], result.size(), input);
+	last_read_mask = mask;
+	cache->Remember(input, mask, start, result);
+	return;
+      }
+    }
+  }
+
+  Step(input);
+  vector<uint8> result;
+  SaveUncompressed(&result);
+  last_read_mask = FCEUI_GetJoyReadMask() & 0xFF;
+  cache->Remember(input, last_read_mask, start, result);
+
+  // Lookups only try SHARED_MASKS, so an entry under any other mask
+  // could never be found.
+  if (shared != NULL && result.size() == before.size() &&
+      std::find(std::begin(SHARED_MASKS), std::end(SHARED_MASKS),
+		last_read_mask) != std::end(SHARED_MASKS)) {
+    uint64 k0, k1;
+    StateCache::MakeKey(start, input, last_read_mask, &k0, &k1);
+    vector<uint8> coded;
+    FCEUSS_EncodeDelta(&result[0], result.size(),
+		       &before[0], before.size(), &coded);
+    shared->Put(k0, k1, &coded[0], coded.size());
+  }
+}
+
+void Emulator::CachingSteps(const vector<uint8> &inputs,
+			    vector< vector<uint8> > *memories,
+			    vector< vector<uint8> > *changed) {
+  if (memories != NULL) memories->resize(inputs.size());
+  if (changed != NULL) changed->resize(inputs.size());
+
+  const bool use_archive = archive != NULL && memories == NULL &&
+    changed == NULL && inputs.size() >= ARCHIVE_MIN_INPUTS;
+  uint128 parent;
+  if (use_archive) {
+    parent = StateFingerprint();
+    StateArchive::Record rec;
+    // Fails without touching the state if it's from another layout.
+    if (archive->FindChild(parent, inputs, &rec) &&
+	FCEUSS_LoadFlatMem(rec.state, rec.state_size)) {
+      joydata = (uint32) inputs.back();
+      FCEUI_RefreshJoyState();
+      return;
+    }
+  }
+
+  vector<uint8> state;
+  uint32 node = SequenceCache::NONE;
+  if (seqcache->budget > 0) {
+    if (seqcache->statesize == 0) {
+      SaveUncompressed(&state);
+      seqcache->Allocate(state.size());
+    }
+    node = seqcache->Root(StateFingerprint());
+  }
 
-    // PERF
-    CHECK(NULL != cache->GetKnownResult(input, start));
+  // Follow the trie as far as it goes, then jump to the deepest
+  // node on the way that has a state.
+  size_t done = 0;
+  if (node != SequenceCache::NONE) {
+    vector<uint32> path;
+    int deepest = -1;
+    for (uint32 cur = node; path.size() < inputs.size(); ) {
+      cur = seqcache->Child(cur, inputs[path.size()]);
+      if (cur == SequenceCache::NONE) break;
+      if (seqcache->nodes[cur].state != SequenceCache::NONE)
+	deepest = path.size();
+      path.push_back(cur);
+    }
+
+    if (deepest >= 0) {
+      seqcache->GetState(path[deepest], &state);
+      LoadUncompressed(&state);
+      // As in CachingStep, the joypad bytes are part of the state.
+      joydata = (uint32) inputs[deepest];
+      FCEUI_RefreshJoyState();
+      if (memories != NULL) {
+	for (int i = 0; i <= deepest; i++)
+	  seqcache->GetRam(path[i], &(*memories)[i]);
+      }
+      if (changed != NULL) {
+	for (int i = 0; i <= deepest; i++)
+	  seqcache->GetChanged(path[i], &(*changed)[i]);
+      }
+      done = deepest + 1;
+      node = path[deepest];
+      seqcache->jumps++;
+      seqcache->frames_skipped += done;
+    }
   }
+
+  // Run the rest, growing the trie.
+  for (size_t i = done; i < inputs.size(); i++) {
+    CachingStep(inputs[i]);
+    if (memories != NULL) GetMemory(&(*memories)[i]);
+    if (changed != NULL)
+      (*changed)[i].assign(RAMChanged, RAMChanged + sizeof (RAMChanged));
+    seqcache->frames_run++;
+    if (node == SequenceCache::NONE) continue;
+    node = seqcache->Extend(node, inputs[i], last_read_mask);
+    if (i + 1 == inputs.size() ||
+	seqcache->nodes[node].depth % SequenceCache::STATE_EVERY == 0) {
+      SaveUncompressed(&state);
+      if (state.size() == seqcache->statesize) {
+	seqcache->SaveState(node, state);
+      } else {
+	// Different game or layout; start over.
+	seqcache->Allocate(state.size());
+	node = SequenceCache::NONE;
+      }
+    }
+  }
+
+  seqcache->MaybeReset();
+
+  if (use_archive) {
+    SaveUncompressed(&state);
+    archive->Put(StateFingerprint(), parent, inputs, state);
+  }
+}
+
+// States only make sense for the same game and flat layout.
+static uint64 GameId() {
+  CHECK(GameInfo != NULL);
+  return CityHash64WithSeed((const char *)GameInfo->MD5.data,
+			    sizeof (GameInfo->MD5.data), FCEUSS_FlatSize());
+}
+
+void Emulator::OpenArchive(const string &basename, uint64 max_bytes) {
+  CHECK(archive == NULL);
+  archive = StateArchive::Open(basename, GameId(), max_bytes);
+}
+
+void Emulator::OpenSharedCache(const string &name, uint64 bytes) {
+  CHECK(shared == NULL);
+  shared = SharedCache::Open(name, GameId(), bytes);
 }
 
 void Emulator::PrintCacheStats() {
   CHECK(cache != NULL);
   cache->PrintStats();
+  seqcache->PrintStats();
+  if (archive != NULL) archive->PrintStats();
+  if (shared != NULL) shared->PrintStats();
+}
+
+void Emulator::PrintCoreStats() {
+  uint64 cycles, skipped, loops;
+  FCEUI_GetIdleLoopStats(&cycles, &skipped, &loops);
+  printf("%s: %llu CPU cycles, %llu (%.2f%%) skipped in %llu idle loops.\n",
+         loaded_romfile.c_str(),
+         (unsigned long long)cycles,
+         (unsigned long long)skipped,
+         cycles > 0 ? (100.0 * skipped) / cycles : 0.0,
+         (unsigned long long)loops);
+}
+
+struct StateHandle::Anchor {
+  explicit Anchor(vector<uint8> *st);
+  ~Anchor();
+  vector<uint8> state;
+};
+
+namespace {
+// Decides when StateHandles are materialized, and keeps track of how
+// much they cost.
+struct HandlePolicy {
+  // Even over budget, replay at most this many inputs.
+  static constexpr int MAX_K = 4096;
+  // A flat state is about 12kb, where the compressed ones that tasbot
+  // used to keep in every node were under 2kb. Materializing at most
+  // every 8 inputs keeps a handle about that size, even though a step
+  // costs far more than a load, for about 4 replayed steps per load.
+  static constexpr int MIN_K = 8;
+
+  uint64 budget = 256ULL << 20;
+  uint64 live_bytes = 0ULL, live = 0ULL;
+
+  // Running averages, in seconds.
+  double load_seconds = 0.0, step_seconds = 0.0;
+
+  uint64 saves = 0ULL, loads = 0ULL, replayed = 0ULL;
+
+  // With a materialized state every k inputs, an average load also
+  // replays k/2 of them. Below k = 2 * load / step that's less than
+  // the load itself, so smaller k would at best halve the time, at
+  // the cost of more memory.
+  int TimeK() const {
+    if (step_seconds <= 0.0) return 1;
+    const double k = 2.0 * load_seconds / step_seconds;
+    return k < 1.0 ? 1 : (k > MAX_K ? MAX_K : (int)k);
+  }
+
+  // Free until half the budget is used; then k doubles for every
+  // sixteenth more, so it's 256 when the budget is all used. This is
+  // just a function of what's live, so it comes back down as handles
+  // are freed.
+  int MemoryK() const {
+    if (live_bytes <= budget / 2) return 1;
+    const uint64 steps = 16 * (live_bytes - budget / 2) / (budget + 1);
+    return steps >= 12 ? MAX_K : (1 << steps);
+  }
+
+  int K() const { return std::max(MIN_K, std::max(TimeK(), MemoryK())); }
+
+  static void Average(double *avg, double sample) {
+    *avg = (*avg == 0.0) ? sample : *avg + (sample - *avg) / 64.0;
+  }
+};
+}  // namespace
+
+static HandlePolicy handle_policy;
+
+static void NoteStepSeconds(double seconds) {
+  HandlePolicy::Average(&handle_policy.step_seconds, seconds);
+}
+
+StateHandle::Anchor::Anchor(vector<uint8> *st) {
+  state.swap(*st);
+  handle_policy.live_bytes += state.size();
+  handle_policy.live++;
+  handle_policy.saves++;
+}
+
+StateHandle::Anchor::~Anchor() {
+  handle_policy.live_bytes -= state.size();
+  handle_policy.live--;
+}
+
+StateHandle StateHandle::Save() {
+  using Clock = std::chrono::steady_clock;
+  const Clock::time_point start = Clock::now();
+  vector<uint8> state;
+  Emulator::SaveUncompressed(&state);
+  // Saving copies the same bytes that loading does, so until there
+  // have been loads, it stands in for their cost.
+  if (handle_policy.loads == 0) {
+    HandlePolicy::Average(&handle_policy.load_seconds,
+                          std::chrono::duration<double>(
+                              Clock::now() - start).count());
+  }
+  StateHandle h;
+  h.anchor = std::make_shared<const Anchor>(&state);
+  return h;
+}
+
+StateHandle StateHandle::After(uint8 input) const {
+  return After(vector<uint8>(1, input));
+}
+
+StateHandle StateHandle::After(const vector<uint8> &inputs) const {
+  CHECK(!IsNull());
+  if (suffix.size() + inputs.size() >= handle_policy.K())
+    return Save();
+  StateHandle h = *this;
+  h.suffix.insert(h.suffix.end(), inputs.begin(), inputs.end());
+  return h;
+}
+
+void StateHandle::Load() const {
+  CHECK(!IsNull());
+  using Clock = std::chrono::steady_clock;
+  const Clock::time_point start = Clock::now();
+  if (!FCEUSS_LoadFlatMem(&anchor->state[0], anchor->state.size())) {
+    fprintf(stderr, "Couldn't load state handle\n");
+    abort();
+  }
+  const Clock::time_point loaded = Clock::now();
+  for (int i = 0; i < suffix.size(); i++) Emulator::Step(suffix[i]);
+
+  // Emulator::Step times the steps.
+  HandlePolicy::Average(&handle_policy.load_seconds,
+                        std::chrono::duration<double>(loaded - start).count());
+  handle_policy.loads++;
+  handle_policy.replayed += suffix.size();
+}
+
+void StateHandle::SetBudget(uint64 bytes) {
+  handle_policy.budget = bytes;
+}
+
+void StateHandle::PrintStats() {
+  const HandlePolicy &p = handle_policy;
+  printf("State handles: %llu materialized (%.1f / %.1f MB), %llu made.\n"
+         "  %llu loads replaying %.2f steps each; load %.1f us, "
+         "step %.1f us; k = %d\n",
+         (unsigned long long)p.live, p.live_bytes / (1024.0 * 1024.0),
+         p.budget / (1024.0 * 1024.0), (unsigned long long)p.saves,
+         (unsigned long long)p.loads,
+         p.loads > 0 ? (double)p.replayed / p.loads : 0.0,
+         1e6 * p.load_seconds, 1e6 * p.step_seconds, p.K());
 }
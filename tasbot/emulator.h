@@ -9,10 +9,12 @@
 #ifndef __EMULATOR_H
 #define __EMULATOR_H
 
+#include <memory>
 #include <vector>
 #include <string>
 
 #include "fceu/types.h"
+#include "../cc-lib/city/city.h"
 
 using namespace std;
 
@@ -26,6 +28,22 @@ struct Emulator {
   // Doesn't modify its argument.
   static void Load(vector<uint8> *in);
 
+  // How Save and SaveEx encode states. Load and LoadEx can read any
+  // of them, so this can be changed at any time.
+  enum Codec {
+    // zlib on the tagged state minus the basis. The smallest, and
+    // the default.
+    CODEC_ZLIB = 0,
+    // The flat state XORed with the basis, with runs of unchanged
+    // and repeated bytes stored as counts. Many times faster than
+    // zlib in both directions, but bigger. Like SaveUncompressed,
+    // only for the same build with the same game.
+    CODEC_FAST = 1,
+  };
+  // level is zlib's, from 1 (fastest) to 9 (smallest), or -1 for
+  // its default. It's ignored by the other codecs.
+  static void SetCodec(Codec codec, int level);
+
   // Make one emulator step with the given input.
   // Bits from MSB to LSB are
   //    RLDUTSBA (Right, Left, Down, Up, sTart, Select, B, A)
@@ -37,6 +55,16 @@ struct Emulator {
   // Copy the 0x800 bytes of RAM.
   static void GetMemory(vector<uint8> *mem);
 
+  // The RAM itself, without copying. Changes as the emulator runs.
+  static const uint8 *GetMemoryPtr();
+
+  // Bitmap of 0x800 bits (RAM byte i is bit i & 7 of byte i >> 3)
+  // of the bytes that were written with a new value during the last
+  // Step or CachingStep. Every byte that differs from before the step
+  // has its bit set, but a byte can also be changed and then set back.
+  // Loading a state doesn't touch it.
+  static const uint8 *GetChangedBits();
+
   // Fancy stuff.
 
   // Same, but run the video and sound code as well. This is slower,
@@ -56,11 +84,12 @@ struct Emulator {
   // of RAM (only). Note there are other important bits of state.
   static uint64 RamChecksum();
 
-  // Reset the state cache. Set the maximum number of states that can
-  // be stored. (A state is a starting state, an input, and the output
-  // state that results.) The number of actual states stored can
-  // exceed numstates by a constant amount called slop. Clears the cache.
-  static void ResetCache(uint64 numstates, uint64 slop = 10000ULL);
+  // Reset the state cache, and set how much memory it may use, in
+  // bytes. (An entry is the output state that results from a starting
+  // state and an input, plus some bookkeeping; the starting state is
+  // only kept as a hash.) A quarter of it goes to the sequence cache
+  // used by CachingSteps. Clears both.
+  static void ResetCache(uint64 bytes);
 
   // Equivalent to Step. Does some extra work to consult the cache and
   // save the result, which may make it much faster. However, when
@@ -68,8 +97,39 @@ struct Emulator {
   // overhead.
   static void CachingStep(uint8 input);
 
+  // Equivalent to calling CachingStep with each input in turn. Whole
+  // sequences are cached as well, in a trie over the inputs from each
+  // starting state, so the longest prefix that's been run from this
+  // state before (if it's still cached) is skipped with a single load.
+  // If memories is non-NULL, it gets the RAM after each step, and if
+  // changed is, GetChangedBits for each step (including the skipped
+  // ones). Unlike CachingStep, leaves GetChangedBits undefined.
+  static void CachingSteps(const vector<uint8> &inputs,
+			   vector< vector<uint8> > *memories,
+			   vector< vector<uint8> > *changed);
+
+  // Opens (or creates) an archive of states on disk (see archive.h),
+  // shared with other processes that open the same one and kept
+  // across runs, for CachingSteps to use. When the caller doesn't
+  // want the memories along the way, a long enough sequence of inputs
+  // that any of them has run from the same state before is just
+  // loaded, and new ones are added. The files take up to max_bytes.
+  static void OpenArchive(const string &basename, uint64 max_bytes);
+
+  // Opens (or creates) a step cache in shared memory (see
+  // sharedcache.h) that every process on the machine that opens the
+  // same name uses along with its own. When CachingStep misses in
+  // the process's cache it looks there, and results it has to run
+  // are added for everyone. It's bytes big, and once it's full it
+  // stops taking new results. Forked processes keep using it.
+  static void OpenSharedCache(const string &name, uint64 bytes);
+
   static void PrintCacheStats();
 
+  // Prints how much CPU time the core has emulated for the loaded
+  // game, and how much of it was fast-forwarded through idle loops.
+  static void PrintCoreStats();
+
   // States often only differ by a small amount, so a way to reduce
   // their entropy is to diff them against a representative savestate.
   // This gets an uncompressed basis for the current state, which can
@@ -79,9 +139,53 @@ struct Emulator {
   // Save and load uncompressed. The memory will always be the same
   // size (Save and SaveEx may compress, which makes their output
   // significantly smaller), but this is the fastest in terms of CPU.
+  // These states are just the emulator's fields copied end to end, so
+  // they can only be loaded by the same build with the same game;
+  // use Save/SaveEx for anything that's written to disk.
+  // LoadUncompressed also accepts the output of GetBasis.
   static void SaveUncompressed(vector<uint8> *out);
   static void LoadUncompressed(vector<uint8> *in);
 
+  // Which parts of the state SaveUncompressed (and the fast codec,
+  // the caches and StateFingerprint) keep. PROFILE_FULL is
+  // everything, and the default. PROFILE_SEARCH leaves out what the
+  // game can't see, like the sound unit's output and frame counters
+  // that are only for the UI; states are smaller, and states that
+  // only differ there are the same state. Not for making video or
+  // sound, then. Uncompressed states from one profile can't be loaded
+  // in the other, so set this before saving any (and call ResetCache
+  // after). Save and SaveEx with the zlib codec always keep
+  // everything.
+  enum Profile {
+    PROFILE_FULL = 0,
+    PROFILE_SEARCH = 1,
+  };
+  static void SetProfile(Profile profile);
+
+  // Checks that a profile loses nothing: plays the inputs from the
+  // current state in PROFILE_FULL and then in the given one, saving
+  // and loading every frame (for the second, with other states loaded
+  // in between, so left-out fields get wrong values), and compares
+  // the RAM and CPU registers after each frame. Returns the first
+  // frame where they differ, after printing the difference, or -1.
+  // Leaves the emulator in the state and profile it started in.
+  static int VerifyProfile(Profile profile, const vector<uint8> &inputs);
+
+  // For trying many things from the same state. MarkBase remembers
+  // the current state, and RestoreBase goes back to it, copying only
+  // the memory that's been written since (in 64-byte blocks) rather
+  // than the whole thing. Any other load still works in between;
+  // it just makes the next RestoreBase a full one.
+  static void MarkBase();
+  static void RestoreBase();
+
+  // A 128-bit hash of the current state, as good as hashing the
+  // output of SaveUncompressed, so equal states have equal
+  // fingerprints. It's maintained incrementally: memory is hashed in
+  // blocks, and only the blocks written since the last call are
+  // hashed again.
+  static uint128 StateFingerprint();
+
   // Save and load with a basis vector. The vector can contain anything, and
   // doesn't even have to be the same length as an uncompressed save state,
   // but a state needs to be loaded with the same basis as it was saved.
@@ -90,5 +194,45 @@ struct Emulator {
   static void LoadEx(vector<uint8> *in, const vector<uint8> *basis);
 };
 
+// A state that may not be stored: the nearest ancestor that is
+// (materialized), plus the inputs that go from there to here. Loading
+// one loads the ancestor and replays the inputs. This trades time for
+// space, and how far is decided by a shared policy: a state is
+// materialized when it'd take k inputs to replay, where k is the
+// smallest number that makes replaying cost about as much as the load
+// itself (from the costs seen so far), but at least 8, and raised as
+// materialized states fill up the memory budget. Ancestors are shared and freed with the
+// last handle that uses them. Copying a handle copies only the inputs.
+class StateHandle {
+ public:
+  // A null handle, which can't be loaded.
+  StateHandle() {}
+
+  // The current state, always materialized.
+  static StateHandle Save();
+
+  // The state reached from this one by the input or inputs. The
+  // emulator has to be in that state already (as right after Load()
+  // and stepping them), because it might be materialized.
+  StateHandle After(uint8 input) const;
+  StateHandle After(const vector<uint8> &inputs) const;
+
+  // Puts the emulator in this state.
+  void Load() const;
+
+  bool IsNull() const { return anchor.get() == nullptr; }
+  // How many inputs Load replays.
+  int Replay() const { return suffix.size(); }
+
+  // Bytes that materialized states may use, all together. The
+  // default is 256MB. Existing handles are unaffected.
+  static void SetBudget(uint64 bytes);
+  static void PrintStats();
+
+ private:
+  struct Anchor;
+  std::shared_ptr<const Anchor> anchor;
+  vector<uint8> suffix;
+};
 
 #endif
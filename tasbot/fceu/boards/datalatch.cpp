@@ -117,6 +117,8 @@ void NROM_Init(CartInfo *info) {
 		info->SaveGameLen[0] = WRAMSIZE;
 	}
 	AddExState(WRAM, WRAMSIZE, 0, "WRAM");
+	// Only written through CartBW, which marks it.
+	FCEUSS_TrackDirty(WRAM, WRAMSIZE);
 }
 
 //------------------ Map 2 ---------------------------
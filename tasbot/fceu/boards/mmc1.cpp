@@ -39,7 +39,10 @@ static int is155, is171;
 static DECLFW(MBWRAM)
 {
   if(!(DRegs[3]&0x10)||is155)
+  {
     Page[A>>11][A]=V;     // WRAM is enabled.
+    FCEUSS_MarkDirty(&Page[A>>11][A]);
+  }
 }
 
 static DECLFR(MAWRAM)
@@ -332,6 +335,7 @@ static void GenMMC1Init(CartInfo *info, int prg, int chr, int wram, int battery)
     if(wram>8) mmc1opts|=4;
     SetupCartPRGMapping(0x10,WRAM,wram*1024,1);
     AddExState(WRAM, wram*1024, 0, "WRAM");
+    FCEUSS_TrackDirty(WRAM, wram*1024);
     if(battery)
     {
       mmc1opts|=2;
@@ -111,7 +111,10 @@ static void mmc5_PPUWrite(uint32 A, uint8 V) {
 		else
 		{
 			if(PPUNTARAM&(1<<((tmp&0xF00)>>10)))
+			{
 				vnapage[((tmp&0xF00)>>10)][tmp&0x3FF]=V;
+				FCEUSS_MarkDirty(&vnapage[((tmp&0xF00)>>10)][tmp&0x3FF]);
+			}
 		}
 }
 
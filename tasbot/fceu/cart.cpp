@@ -32,6 +32,7 @@
 
 #include "cart.h"
 #include "x6502.h"
+#include "state.h"
 
 #include "file.h"
 #include "utils/memory.h"
@@ -44,6 +45,7 @@ uint8 *MMC5SPRVPage[8];
 uint8 *MMC5BGVPage[8];
 
 static uint8 PRGIsRAM[32];  /* This page is/is not PRG RAM. */
+uint32 PRGMapGeneration=1;
 
 /* 16 are (sort of) reserved for UNIF/iNES and 16 to map other stuff. */
 static int CHRram[32];
@@ -80,6 +82,7 @@ static INLINE void setpageptr(int s, uint32 A, uint8 *p, int ram)
 	uint32 AB=A>>11;
 	int x;
 
+	PRGMapGeneration++;
 	if(p)
 		for(x=(s>>1)-1;x>=0;x--)
 		{
@@ -101,6 +104,7 @@ void ResetCartMapping(void)
 
 	PPU_ResetHooks();
 
+	PRGMapGeneration++;
 	for(x=0;x<32;x++)
 	{
 		Page[x]=nothing-x*2048;
@@ -150,7 +154,15 @@ DECLFW(CartBW)
 {
 	//printf("Ok: %04x:%02x, %d\n",A,V,PRGIsRAM[A>>11]);
 	if(PRGIsRAM[A>>11] && Page[A>>11])
+	{
 		Page[A>>11][A]=V;
+		FCEUSS_MarkDirty(&Page[A>>11][A]);
+	}
+}
+
+bool CartPageIsROM(uint32 A)
+{
+	return Page[A>>11] && !PRGIsRAM[A>>11];
 }
 
 DECLFR(CartBROB)
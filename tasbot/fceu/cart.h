@@ -27,6 +27,13 @@ void FCEU_ClearGameSave(CartInfo *LocalHWInfo);
 
 extern uint8 *Page[32],*VPage[8],*MMC5SPRVPage[8],*MMC5BGVPage[8];
 
+/* Bumped whenever the CPU's view of PRG space may change: a bank
+   switch or a new read handler.  Anything cached about code in PRG-ROM
+   is good as long as this stays the same. */
+extern uint32 PRGMapGeneration;
+/* True if the 2K page at A>>11 is mapped to PRG-ROM (not PRG-RAM). */
+bool CartPageIsROM(uint32 A);
+
 void ResetCartMapping(void);
 void SetupCartPRGMapping(int chip, uint8 *p, uint32 size, int ram);
 void SetupCartCHRMapping(int chip, uint8 *p, uint32 size, int ram);
@@ -30,6 +30,7 @@
 #include "fceu.h"
 #include "file.h"
 #include "cart.h"
+#include "state.h"
 #include "driver.h"
 #include "utils/memory.h"
 
@@ -438,7 +439,10 @@ void FCEU_ApplyPeriodicCheats(void)
 	{
 		if(cur->status && !(cur->type))
 			if(CheatRPtrs[cur->addr>>10])
+			{
 				CheatRPtrs[cur->addr>>10][cur->addr]=cur->val;
+				FCEUSS_MarkDirty(&CheatRPtrs[cur->addr>>10][cur->addr]);
+			}
 		if(cur->next)
 			cur=cur->next;
 		else
@@ -942,7 +946,10 @@ int FCEU_CheatGetByte(uint32 A)
 void FCEU_CheatSetByte(uint32 A, uint8 V)
 {
    if(CheatRPtrs[A>>10])
+   {
     CheatRPtrs[A>>10][A]=V;
+    FCEUSS_MarkDirty(&CheatRPtrs[A>>10][A]);
+   }
    else if(A < 0x10000)
     BWrite[A](A, V);
 }
@@ -80,6 +80,14 @@ bool FCEUI_GetInputFourscore();
 //tells whether the microphone is used
 bool FCEUI_GetInputMicrophone();
 
+//Which bits of the gamepad data (laid out like the SetInput pointer)
+//the game has read this frame. Frames that agree on these bits run
+//the same way, except for the joypad bytes in the savestate; after
+//loading such a state, FCEUI_RefreshJoyState puts the current input
+//back in them. All ones if the input devices aren't plain gamepads.
+uint32 FCEUI_GetJoyReadMask(void);
+void FCEUI_RefreshJoyState(void);
+
 void FCEUI_UseInputPreset(int preset);
 
 
@@ -95,6 +103,20 @@ void FCEUI_DisableSpriteLimitation(int a);
 void FCEUI_SetRenderPlanes(bool sprites, bool bg);
 void FCEUI_GetRenderPlanes(bool& sprites, bool& bg);
 
+//When true (the default), frames emulated with skip don't draw into XBuf.
+//The emulation is otherwise identical. Light guns read the pixels, so
+//turn this off if one is plugged in.
+void FCEUI_SetHeadlessPPU(bool headless);
+
+//When true (the default), the CPU fast-forwards through loops that just
+//spin reading memory (e.g. waiting for NMI). This is exact; turn it off
+//only to check that claim.
+void FCEUI_SetIdleLoopSkip(bool skip);
+
+//Total CPU cycles emulated, and how many of those were skipped in how
+//many idle loop fast-forwards.
+void FCEUI_GetIdleLoopStats(uint64 *cycles, uint64 *skipped, uint64 *loops);
+
 //name=path and file to load.  returns null if it failed
 FCEUGI *FCEUI_LoadGame(const char *name, int OverwriteVidMode);
 
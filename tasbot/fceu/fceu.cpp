@@ -135,6 +135,8 @@ bool CheckFileExists(const char* filename)
 void FCEU_TogglePPU(void)
 {
 	newppu ^= 1;
+	// The search profile depends on which PPU is in use.
+	FCEUSS_SetProfile(FCEUSS_GetProfile());
 	if (newppu)
 	{
 		FCEU_DispMessage("New PPU loaded", 0);
@@ -222,6 +224,8 @@ void (*GameStateRestore)(int version);
 
 readfunc ARead[0x10000];
 writefunc BWrite[0x10000];
+uint8 FastReadPage[32];
+uint8 FastWritePage[32];
 static readfunc *AReadG;
 static writefunc *BWriteG;
 static int RWWrap=0;
@@ -283,6 +287,7 @@ void FlushGenieRW(void)
 		AReadG=0;
 		BWriteG=0;
 		RWWrap=0;
+		FCEU_UpdateFastPages(0x8000,0xFFFF);
 	}
 }
 
@@ -311,6 +316,7 @@ void SetReadHandler(int32 start, int32 end, readfunc func)
 
 		for(x=end;x>=start;x--)
 			ARead[x]=func;
+	FCEU_UpdateFastPages(start,end);
 }
 
 writefunc GetWriteHandler(int32 a)
@@ -339,10 +345,12 @@ void SetWriteHandler(int32 start, int32 end, writefunc func)
 	else
 		for(x=end;x>=start;x--)
 			BWrite[x]=func;
+	FCEU_UpdateFastPages(start,end);
 }
 
 uint8 *GameMemBlock;
 uint8 *RAM;
+uint8 RAMChanged[0x800>>3];
 
 //---------
 //windows might need to allocate these differently, so we have some special code
@@ -364,7 +372,7 @@ uint8 PAL=0;
 
 static DECLFW(BRAML)
 {
-	RAM[A]=V;
+	FCEU_WriteRAM(A,V);
 	#ifdef _S9XLUA_H
 	CallRegisteredLuaMemHook(A, 1, V, LUAMEMHOOK_WRITE);
 	#endif
@@ -372,7 +380,7 @@ static DECLFW(BRAML)
 
 static DECLFW(BRAMH)
 {
-	RAM[A&0x7FF]=V;
+	FCEU_WriteRAM(A&0x7FF,V);
 	#ifdef _S9XLUA_H
 	CallRegisteredLuaMemHook(A&0x7FF, 1, V, LUAMEMHOOK_WRITE);
 	#endif
@@ -388,6 +396,41 @@ static DECLFR(ARAMH)
 	return RAM[A&0x7FF];
 }
 
+//True if reading A has no side effects and just returns a byte of
+//RAM, PRG-RAM or PRG-ROM, so that it can only change if something
+//writes it or the mapper switches banks.
+bool FCEU_IsPlainRead(uint32 A)
+{
+	readfunc f=ARead[A];
+	return f==ARAML || f==ARAMH || f==CartBR;
+}
+
+//Reclassifies the 2K pages overlapping start..end. A page is fast if
+//every address in it has the same plain RAM or cartridge handler, so
+//that the CPU can skip the call.
+void FCEU_UpdateFastPages(int32 start, int32 end)
+{
+	for(int32 p=start>>11;p<=(end>>11);p++)
+	{
+		uint32 A=p<<11;
+		uint8 r=FASTMEM_NONE, w=FASTMEM_NONE;
+		if(ARead[A]==ARAML || ARead[A]==ARAMH)
+			r=FASTMEM_RAM;
+		else if(ARead[A]==CartBR)
+			r=FASTMEM_CART;
+		if(BWrite[A]==BRAML || BWrite[A]==BRAMH)
+			w=FASTMEM_RAM;
+		for(uint32 x=A+1;x<A+0x800;x++)
+		{
+			if(ARead[x]!=ARead[A]) r=FASTMEM_NONE;
+			if(BWrite[x]!=BWrite[A]) w=FASTMEM_NONE;
+		}
+		FastReadPage[p]=r;
+		FastWritePage[p]=w;
+	}
+	PRGMapGeneration++;
+}
+
 
 void ResetGameLoaded(void)
 {
@@ -646,6 +689,8 @@ void FCEUI_Emulate(uint8 **pXBuf, int32 **SoundBuf, int32 *SoundBufSize, int ski
 
   JustFrameAdvanced = false;
 
+  memset(RAMChanged,0,sizeof(RAMChanged));
+
   if (frameAdvanceRequested) {
     if (frameAdvanceDelay==0 || frameAdvanceDelay>=10)
       EmulationPaused = 3;
@@ -742,6 +787,7 @@ void ResetNES(void)
 	FCEUSND_Reset();
 	FCEUPPU_Reset();
 	X6502_Reset();
+	FCEUSS_MarkAllDirty();
 
 	// clear back baffer
 	extern uint8 *XBackBuf;
@@ -808,6 +854,7 @@ void PowerNES(void)
   X6502_Power();
   FCEU_PowerCheats();
   LagCounterReset();
+  FCEUSS_MarkAllDirty();
   // clear back baffer
   extern uint8 *XBackBuf;
   memset(XBackBuf,0,256*256);
@@ -1,6 +1,8 @@
 #ifndef _FCEUH
 #define _FCEUH
 
+#include "state.h"
+
 extern int fceuindbg;
 extern int newppu;
 void ResetGameLoaded(void);
@@ -13,6 +15,7 @@ void SetReadHandler(int32 start, int32 end, readfunc func);
 void SetWriteHandler(int32 start, int32 end, writefunc func);
 writefunc GetWriteHandler(int32 a);
 readfunc GetReadHandler(int32 a);
+bool FCEU_IsPlainRead(uint32 A);
 
 int AllocGenieRW(void);
 void FlushGenieRW(void);
@@ -48,6 +51,21 @@ extern uint8 MMC5HackSPPage;
 
 extern  uint8  *RAM;            //shared memory modifications
 extern  uint8  *GameMemBlock;   //shared memory modifications
+
+//One bit per byte of RAM (bit A&7 of byte A>>3): written since the
+//start of the frame with a value different from what was there.
+//FCEUI_Emulate clears it. A byte can be changed and then set back, so
+//these are a superset of the bytes that differ.
+extern uint8 RAMChanged[0x800>>3];
+
+//Every CPU write to RAM goes through here, so that it's counted above
+//and in RAMDirty for the savestate base and fingerprint.
+static INLINE void FCEU_WriteRAM(uint32 A, uint8 V)
+{
+	if(RAM[A]!=V) RAMChanged[A>>3]|=1<<(A&7);
+	RAMDirty[A>>FCEUSS_DIRTY_SHIFT]=FCEUSS_DIRTY_ALL;
+	RAM[A]=V;
+}
 extern int EmulationPaused;
 
 uint8 FCEU_ReadRomByte(uint32 i);
@@ -55,6 +73,15 @@ uint8 FCEU_ReadRomByte(uint32 i);
 extern readfunc ARead[0x10000];
 extern writefunc BWrite[0x10000];
 
+//For each 2K page of CPU address space, whether reads (writes) can go
+//straight to RAM or through Page[] instead of calling the handler.
+//Kept up to date by SetReadHandler/SetWriteHandler; anything that
+//writes ARead/BWrite directly must call FCEU_UpdateFastPages.
+enum { FASTMEM_NONE=0, FASTMEM_RAM, FASTMEM_CART };
+extern uint8 FastReadPage[32];
+extern uint8 FastWritePage[32];
+void FCEU_UpdateFastPages(int32 start, int32 end);
+
 enum GI {
         GI_RESETM2      =1,
         GI_POWER =2,
@@ -1431,6 +1431,7 @@ void (*MapInitTab[256])(void)=
 static DECLFW(BWRAM)
 {
 	WRAM[A-0x6000]=V;
+	FCEUSS_MarkDirty(&WRAM[A-0x6000]);
 }
 
 static DECLFR(AWRAM)
@@ -1497,6 +1498,7 @@ static void iNESPower(void)
 		AddExState(FCEUVSUNI_STATEINFO, ~0, 0, 0);
 
 	AddExState(WRAM, 8192, 0, "WRAM");
+	FCEUSS_TrackDirty(WRAM, 8192);
 	if(type==19 || type==6 || type==69 || type==85 || type==96)
 		AddExState(MapperExRAM, 32768, 0, "MEXR");
 	if((!VROM_size || type==6 || type==19) && (type!=13 && type!=96))
@@ -88,6 +88,8 @@ extern bool movieSubtitles;
 
 static uint8 joy_readbit[2];
 uint8 joy[4]={0,0,0,0}; //HACK - should be static but movie needs it
+//Which bits of joy[] the game has read since the last FCEU_UpdateInput.
+static uint8 joy_read[4];
 static uint8 LastStrobe;
 
 bool replaceP2StartWithMicrophone = false;
@@ -136,6 +138,7 @@ static DECLFR(JPRead)
 
 	// Not verified against hardware.
 	if (replaceP2StartWithMicrophone) {
+		joy_read[1]|=8;
 		if (joy[1]&8) {
 			microphone = !microphone;
 			if (microphone) {
@@ -217,6 +220,7 @@ static uint8 ReadGPVS(int w)
 	else
 	{
 		ret = ((joy[w]>>(joy_readbit[w]))&1);
+		joy_read[w]|=1<<joy_readbit[w];
 		if(!fceuindbg)
 			joy_readbit[w]++;
 	}
@@ -291,6 +295,8 @@ static uint8 ReadGP(int w)
 	else
 		ret = ((joy[w]>>(joy_readbit[w]))&1);
 	if(joy_readbit[w]>=16) ret=0;
+	else if(joy_readbit[w]>=8) joy_read[2+w]|=1<<(joy_readbit[w]&7);
+	else joy_read[w]|=1<<joy_readbit[w];
 	if(!FSAttached)
 	{
 		if(joy_readbit[w]>=8) ret|=1;
@@ -326,6 +332,8 @@ void FCEU_DrawInput(uint8 *buf)
 
 void FCEU_UpdateInput(void)
 {
+	memset(joy_read,0,sizeof(joy_read));
+
 	//tell all drivers to poll input and set up their logical states
 	if(!FCEUMOV_Mode(MOVIEMODE_PLAY))
 	{
@@ -347,6 +355,26 @@ void FCEU_UpdateInput(void)
 		FCEU_VSUniSwap(&joy[0],&joy[1]);
 }
 
+uint32 FCEUI_GetJoyReadMask(void)
+{
+	//Only plain gamepads are tracked, and only when joy[] really is
+	//just the input for the frame.
+	for(int port=0;port<2;port++)
+		if(joyports[port].driver!=&GPC && joyports[port].driver!=&DummyJPort)
+			return 0xFFFFFFFF;
+	if(portFC.driver && portFC.driver!=&DummyPortFC)
+		return 0xFFFFFFFF;
+	if(!FCEUMOV_Mode(MOVIEMODE_INACTIVE) || FCEUnetplay || GameInfo->type==GIT_VSUNI)
+		return 0xFFFFFFFF;
+	return joy_read[0] | (joy_read[1]<<8) | (joy_read[2]<<16) | (joy_read[3]<<24);
+}
+
+void FCEUI_RefreshJoyState(void)
+{
+	for(int port=0;port<2;port++)
+		joyports[port].driver->Update(port,joyports[port].ptr,joyports[port].attrib);
+}
+
 static DECLFR(VSUNIRead0)
 {
 	lagFlag = 0;
@@ -32,7 +32,10 @@ static uint8 sunindex;
 static DECLFW(SUN5BWRAM)
 {
  if((sungah&0xC0)==0xC0)
+ {
   (WRAM-0x6000)[A]=V;
+  FCEUSS_MarkDirty(&(WRAM-0x6000)[A]);
+ }
 }
 
 static DECLFR(SUN5AWRAM)
@@ -38,6 +38,7 @@
 #include "fds.h"
 #include "cart.h"
 #include "input.h"
+#include "state.h"
 #include "driver.h"
 #ifdef _S9XLUA_H
 #include "fceulua.h"
@@ -416,6 +417,7 @@ static DECLFR(NSF_read)
 		if(!fceuindbg)
 		{
 			memset(RAM,0x00,0x800);
+			FCEUSS_MarkAllDirty();
 
 			BWrite[0x4015](0x4015,0x0);
 			for(x=0;x<0x14;x++)
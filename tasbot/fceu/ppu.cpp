@@ -79,8 +79,6 @@ static uint32 ppulut1[256];
 static uint32 ppulut2[256];
 static uint32 ppulut3[128];
 
-int test = 0;
-
 static const char *bits8(uint8 b) {
   static char buf[9] = {0};
   for (int i = 0; i < 8; i ++) {
@@ -444,7 +442,10 @@ inline void FFCEUX_PPUWrite_Default(uint32 A, uint8 V) {
     else if (tmp<0x3F00)
     {
         if(PPUNTARAM&(1<<((tmp&0xF00)>>10)))
+        {
             vnapage[((tmp&0xF00)>>10)][tmp&0x3FF]=V;
+            FCEUSS_MarkDirty(&vnapage[((tmp&0xF00)>>10)][tmp&0x3FF]);
+        }
     }
     else
     {
@@ -1067,7 +1068,10 @@ static DECLFW(B2007)
 		else
 		{
 			if(PPUNTARAM&(1<<((tmp&0xF00)>>10)))
+			{
 				vnapage[((tmp&0xF00)>>10)][tmp&0x3FF]=V;
+				FCEUSS_MarkDirty(&vnapage[((tmp&0xF00)>>10)][tmp&0x3FF]);
+			}
 		}
 		//      FCEU_printf("ppu (%04x) %04x:%04x %d, %d\n",X.PC,RefreshAddr,PPUGenLatch,scanline,timestamp);
 		if(INC32) RefreshAddr+=32;
@@ -1126,12 +1130,23 @@ void FCEUPPU_LineUpdate(void)
 
 static bool rendersprites=true, renderbg=true;
 
+//Headless frames skip composing pixels into XBuf, but still emulate
+//everything the game can observe (VRAM address increments, sprite 0
+//hit, sprite overflow and the mapper hooks). nopixels is set per
+//frame by FCEUPPU_Loop, for frames that are skipped anyway.
+static bool headlessppu=true, nopixels=false;
+
 void FCEUI_SetRenderPlanes(bool sprites, bool bg)
 {
 	rendersprites = sprites;
 	renderbg = bg;
 }
 
+void FCEUI_SetHeadlessPPU(bool headless)
+{
+	headlessppu = headless;
+}
+
 void FCEUI_GetRenderPlanes(bool& sprites, bool& bg)
 {
 	sprites = rendersprites;
@@ -1353,6 +1368,20 @@ static void RefreshLine(int lastpixel)
 #undef PPUT_HOOK
 		norecurse=0;
 	}
+	else if(nopixels && sphitx==0x100)
+	{
+		//Nobody will look at these pixels, and there's no sprite 0
+		//on this line to hit them. So only advance the address the way
+		//pputile.inc would. (The MMC5 and PPU_hook cases above have
+		//side effects per fetch, so they always do the full work.)
+		for(X1=firsttile;X1<lasttile;X1++)
+		{
+			if((RefreshAddr&0x1f)==0x1f)
+				RefreshAddr^=0x41F;
+			else
+				RefreshAddr++;
+		}
+	}
 	else
 	{
 		for(X1=firsttile;X1<lasttile;X1++)
@@ -1463,7 +1492,7 @@ static void DoLine(void)
 	X6502_Run(256);
 	EndRL();
 
-	if(!renderbg)  // User asked to not display background data.
+	if(!renderbg && !nopixels)  // User asked to not display background data.
 	{
 		uint32 tem;
 		uint8 col;
@@ -1482,25 +1511,28 @@ static void DoLine(void)
 	// What is this?? ORs every byte in the buffer with 0x30 if PPU[1] has its lowest
 	// bit set.
 
-	if(ScreenON || SpriteON)  // Yes, very el-cheapo.
+	if(!nopixels)
 	{
-		if(PPU[1]&0x01)
+		if(ScreenON || SpriteON)  // Yes, very el-cheapo.
+		{
+			if(PPU[1]&0x01)
+			{
+				for(x=63;x>=0;x--)
+					*(uint32 *)&target[x<<2]=(*(uint32*)&target[x<<2])&0x30303030;
+			}
+		}
+		if((PPU[1]>>5)==0x7)
 		{
 			for(x=63;x>=0;x--)
-				*(uint32 *)&target[x<<2]=(*(uint32*)&target[x<<2])&0x30303030;
+				*(uint32 *)&target[x<<2]=((*(uint32*)&target[x<<2])&0x3f3f3f3f)|0xc0c0c0c0;
 		}
+		else if(PPU[1]&0xE0)
+			for(x=63;x>=0;x--)
+				*(uint32 *)&target[x<<2]=(*(uint32*)&target[x<<2])|0x40404040;
+		else
+			for(x=63;x>=0;x--)
+				*(uint32 *)&target[x<<2]=((*(uint32*)&target[x<<2])&0x3f3f3f3f)|0x80808080;
 	}
-	if((PPU[1]>>5)==0x7)
-	{
-		for(x=63;x>=0;x--)
-			*(uint32 *)&target[x<<2]=((*(uint32*)&target[x<<2])&0x3f3f3f3f)|0xc0c0c0c0;
-	}
-	else if(PPU[1]&0xE0)
-		for(x=63;x>=0;x--)
-			*(uint32 *)&target[x<<2]=(*(uint32*)&target[x<<2])|0x40404040;
-	else
-		for(x=63;x>=0;x--)
-			*(uint32 *)&target[x<<2]=((*(uint32*)&target[x<<2])&0x3f3f3f3f)|0x80808080;
 
 	sphitx=0x100;
 
@@ -1725,20 +1757,24 @@ static void FetchSpriteData(void)
 
 static void RefreshSprites(void)
 {
-	int n;
+	int n,first;
 	SPRB *spr;
 
 	spork=0;
 	if(!numsprites) return;
 
 	// Initialize the line buffer to 0x80, meaning "no pixel here."
-	FCEU_dwmemset(sprlinebuf,0x80808080,256);
+	if(!nopixels)
+		FCEU_dwmemset(sprlinebuf,0x80808080,256);
 	numsprites--;
-	spr = (SPRB*)SPRBUF+numsprites;
+	// When headless, the line buffer isn't drawn, so only sprite 0
+	// (for the hit check) needs to be looked at.
+	first=nopixels?0:numsprites;
+	spr = (SPRB*)SPRBUF+first;
 
 	DEBUGF(stderr, "RefreshSprites @%d with numsprites = %d\n", 
 		scanline, numsprites);
-	for(n=numsprites;n>=0;n--,spr--)
+	for(n=first;n>=0;n--,spr--)
 	{
 		int x=spr->x;
 		uint8 *C;
@@ -1785,6 +1821,8 @@ static void RefreshSprites(void)
 					((J>>7)&0x01);
 			}
 
+			if(nopixels) continue;
+
 			// C is destination for the 8 pixels we'll write
 			// on this scanline.
 			// C is an array of bytes, each corresponding to
@@ -1890,7 +1928,7 @@ static void CopySprites(uint8 *target)
   if(!spork) return;
   spork=0;
 
-  if(!rendersprites) return;  //User asked to not display sprites.
+  if(!rendersprites || nopixels) return;  //User asked to not display sprites.
 
 #if 0
   fprintf(stderr, "CS (n=%d) @%d:\n", n, scanline);
@@ -2075,10 +2113,13 @@ void FCEUPPU_Power(void)
 		BWrite[x+7]=B2007;
 	}
 	BWrite[0x4014]=B4014;
+	FCEU_UpdateFastPages(0x2000,0x4014);
 }
 
 int FCEUPPU_Loop(int skip)
 {
+	nopixels=skip && headlessppu;
+
 	if((newppu) && (GameInfo->type!=GIT_NSF)) {
 		int FCEUX_PPU_Loop(int skip);
 		return FCEUX_PPU_Loop(skip);
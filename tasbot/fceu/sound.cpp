@@ -581,6 +581,24 @@ fhcnt-=cycles*48;
  }
 }
 
+//Number of CPU cycles that FCEU_SoundCPUHook could be fed without
+//anything happening (no frame counter step, DMC fetch or DMC bit).
+//Used to fast-forward idle loops.
+int32 FCEU_SoundIdleCycles(void)
+{
+ if(DMCSize && !DMCHaveDMA) return 0;
+ int32 c=(fhcnt-1)/48;
+ if(DMCacc-1<c) c=DMCacc-1;
+ return c>0?c:0;
+}
+
+//Same as FCEU_SoundCPUHook(cycles) if cycles<=FCEU_SoundIdleCycles().
+void FCEU_SoundSkipCycles(int32 cycles)
+{
+ fhcnt-=cycles*48;
+ DMCacc-=cycles;
+}
+
 void RDoPCM(void)
 {
  uint32 V; //mbg merge 7/17/06 made uint32
@@ -69,6 +69,8 @@ void FCEUSND_SaveState(void);
 void FCEUSND_LoadState(int version);
 
 void FCEU_SoundCPUHook(int);
+int32 FCEU_SoundIdleCycles(void);
+void FCEU_SoundSkipCycles(int32 cycles);
 void Write_IRQFM (uint32 A, uint8 V); //mbg merge 7/17/06 brought over from latest mmbuild
 
 void LogDPCM(int romaddress, int dpcmsize);
@@ -27,6 +27,7 @@
 
 #include <vector>
 #include <fstream>
+#include <algorithm>
 
 #include "version.h"
 #include "types.h"
@@ -46,6 +47,7 @@
 #include "input.h"
 #include "zlib.h"
 #include "driver.h"
+#include "city.h"
 
 using namespace std;
 
@@ -391,6 +393,7 @@ bool FCEUSS_LoadRAW(std::vector<uint8> *in) {
   // is->fread(memory_savestate.buf(), totalsize);
 
   FCEUMOV_PreLoad();
+  FCEUSS_MarkAllDirty();
 
   bool success = (ReadStateChunks(&is, totalsize) != 0);
 
@@ -407,6 +410,741 @@ bool FCEUSS_LoadRAW(std::vector<uint8> *in) {
   }
 }
 
+// Flat in-memory savestates. The SFORMAT tables fix the set of fields
+// once the game is loaded, so instead of writing a tag and length for
+// each one and looking them up again by tag, we lay them out back to
+// back in save order. Each field also remembers where the tagged
+// loader would have put it (CheckS finds the first field with that tag
+// and size in the chunk's table, or none), so loading a flat state does
+// exactly what loading the same tagged state does. The layout is
+// rebuilt after AddExState/ResetExState change SFMDATA.
+//
+// A flat state starts with a magic number and a signature of the
+// layout, and only makes sense to the same build with the same game
+// loaded; the tagged format is still the one to use for anything
+// that's kept around.
+namespace {
+struct FlatField {
+  SFORMAT *src;
+  // NULL if the tagged loader would skip it.
+  SFORMAT *dst;
+  uint32 size;
+};
+}
+
+static vector<FlatField> flatfields;
+// Index of the first SFMDATA field, which are saved between the
+// SPreSave/SPostSave hooks.
+static uint32 flatexstart = 0;
+// Index of the first field of each SFORMAT table.
+static vector<uint32> flatsections;
+static uint32 flatsize = 0, flatsig = 0;
+static bool flatvalid = false;
+
+static const uint32 FLAT_MAGIC = 0xF1A7BA5E;
+static const uint32 FLAT_HEADER = 8;
+
+static int flatprofile = FCEUSS_PROFILE_FULL;
+
+// Fields that the search profile leaves out. Nothing the game can
+// see depends on them: the sound unit's envelopes, sweeps, linear
+// counter and noise register only feed the output samples (the length
+// counters, frame counter and DMC, which the game can read or which
+// cause IRQs, are kept), the lag and frame counters are for the
+// UI and FCEUX's own movies, and the joypad bits are replaced by the
+// new input at the start of every frame, before the game can read
+// them. Checked with Emulator::VerifyProfile.
+namespace {
+struct OmittedField {
+  SFORMAT *table;
+  const char *desc;
+};
+}
+static const OmittedField searchomitted[] = {
+  { FCEUSND_STATEINFO, "E0SP" }, { FCEUSND_STATEINFO, "E1SP" },
+  { FCEUSND_STATEINFO, "E2SP" }, { FCEUSND_STATEINFO, "E0MO" },
+  { FCEUSND_STATEINFO, "E1MO" }, { FCEUSND_STATEINFO, "E2MO" },
+  { FCEUSND_STATEINFO, "E0D1" }, { FCEUSND_STATEINFO, "E1D1" },
+  { FCEUSND_STATEINFO, "E2D1" }, { FCEUSND_STATEINFO, "E0DV" },
+  { FCEUSND_STATEINFO, "E1DV" }, { FCEUSND_STATEINFO, "E2DV" },
+  { FCEUSND_STATEINFO, "SWEE" }, { FCEUSND_STATEINFO, "CRF1" },
+  { FCEUSND_STATEINFO, "CRF2" }, { FCEUSND_STATEINFO, "SWCT" },
+  { FCEUSND_STATEINFO, "TRIM" }, { FCEUSND_STATEINFO, "TRIC" },
+  { FCEUSND_STATEINFO, "NREG" },
+  { FCEUCTRL_STATEINFO, "LAGC" }, { FCEUCTRL_STATEINFO, "FRAM" },
+  { FCEUCTRL_STATEINFO, "JOYS" },
+};
+
+static bool InProfile(SFORMAT *table, SFORMAT *sf) {
+  if (flatprofile != FCEUSS_PROFILE_SEARCH) return true;
+  for (int i = 0; i < sizeof (searchomitted) / sizeof (searchomitted[0]);
+       i++) {
+    if (searchomitted[i].table == table &&
+        !memcmp(searchomitted[i].desc, sf->desc, 4))
+      return false;
+  }
+  return true;
+}
+
+static inline uint8 *FieldPtr(SFORMAT *sf) {
+  if (sf->s & FCEUSTATE_INDIRECT) return *(uint8 **)sf->v;
+  return (uint8 *)sf->v;
+}
+
+static void AddFlatFields(SFORMAT *table, SFORMAT *sf) {
+  for (; sf->v; sf++) {
+    if (sf->s == ~0) {
+      AddFlatFields(table, (SFORMAT *)sf->v);
+      continue;
+    }
+    if (!InProfile(table, sf)) continue;
+    FlatField f;
+    f.src = sf;
+    f.size = sf->s & ~FCEUSTATE_FLAGS;
+    f.dst = CheckS(table, f.size, sf->desc);
+    flatfields.push_back(f);
+  }
+}
+
+static void AddFlatSection(SFORMAT *table) {
+  flatsections.push_back(flatfields.size());
+  AddFlatFields(table, table);
+}
+
+static void BuildFlatLayout() {
+  flatfields.clear();
+  flatsections.clear();
+  AddFlatSection(SFCPU);
+  AddFlatSection(SFCPUC);
+  AddFlatSection(FCEUPPU_STATEINFO);
+  // Only the new PPU reads its state; the old one just keeps some
+  // of it up to date when registers are written.
+  if (flatprofile != FCEUSS_PROFILE_SEARCH || newppu)
+    AddFlatSection(FCEU_NEWPPU_STATEINFO);
+  AddFlatSection(FCEUCTRL_STATEINFO);
+  AddFlatSection(FCEUSND_STATEINFO);
+  flatexstart = flatfields.size();
+  AddFlatSection(SFMDATA);
+
+  flatsize = 0;
+  flatsig = (2166136261U ^ flatprofile) * 16777619U;
+  for (int i = 0; i < flatfields.size(); i++) {
+    flatsize += flatfields[i].size;
+    flatsig = (flatsig ^ flatfields[i].size) * 16777619U;
+    flatsig = (flatsig ^ (flatfields[i].dst != NULL)) * 16777619U;
+  }
+  flatvalid = true;
+}
+
+bool FCEUSS_SaveFlat(std::vector<uint8> *out) {
+  if (!flatvalid) BuildFlatLayout();
+
+  FCEUPPU_SaveState();
+  FCEUSND_SaveState();
+
+  out->resize(FLAT_HEADER + flatsize);
+  uint8 *p = &(*out)[0];
+  memcpy(p, &FLAT_MAGIC, 4);
+  memcpy(p + 4, &flatsig, 4);
+  p += FLAT_HEADER;
+
+  for (uint32 i = 0; i < flatexstart; i++) {
+    memcpy(p, FieldPtr(flatfields[i].src), flatfields[i].size);
+    p += flatfields[i].size;
+  }
+
+  // Same (odd) test as FCEUSS_SaveRAW.
+  if(SPreSave) SPreSave();
+  for (uint32 i = flatexstart; i < flatfields.size(); i++) {
+    memcpy(p, FieldPtr(flatfields[i].src), flatfields[i].size);
+    p += flatfields[i].size;
+  }
+  if(SPreSave) SPostSave();
+
+  return true;
+}
+
+bool FCEUSS_IsFlat(const std::vector<uint8> *in) {
+  if (!flatvalid) BuildFlatLayout();
+  uint32 magic, sig;
+  if (in->size() != FLAT_HEADER + flatsize) return false;
+  memcpy(&magic, &(*in)[0], 4);
+  memcpy(&sig, &(*in)[4], 4);
+  return magic == FLAT_MAGIC && sig == flatsig;
+}
+
+uint32 FCEUSS_FlatSize(void) {
+  if (!flatvalid) BuildFlatLayout();
+  return FLAT_HEADER + flatsize;
+}
+
+void FCEUSS_FlatChunks(std::vector<uint32> *starts) {
+  if (!flatvalid) BuildFlatLayout();
+
+  starts->clear();
+  starts->push_back(0);
+  uint32 offset = FLAT_HEADER;
+  uint32 section = 0;
+  bool lastbig = false;
+  for (uint32 i = 0; i < flatfields.size(); i++) {
+    const uint32 size = flatfields[i].size;
+    const bool big = size >= FCEUSS_FLAT_CHUNK;
+    bool cut = big || lastbig;
+    while (section < flatsections.size() && flatsections[section] <= i) {
+      cut = true;
+      section++;
+    }
+    if (cut && offset > starts->back()) starts->push_back(offset);
+    if (big) {
+      for (uint32 o = FCEUSS_FLAT_CHUNK; o < size; o += FCEUSS_FLAT_CHUNK)
+        starts->push_back(offset + o);
+    }
+    lastbig = big;
+    offset += size;
+  }
+}
+
+// Everything after copying the fields in, for LoadFlat and RestoreBase.
+static bool FinishFlatLoad() {
+  // As in ReadStateChunks, which would have seen the sound chunk.
+  extern int resetDMCacc;
+  resetDMCacc = 0;
+
+  if(GameStateRestore) {
+    GameStateRestore(FCEU_VERSION_NUMERIC);
+  }
+
+  FCEUPPU_LoadState(FCEU_VERSION_NUMERIC);
+  FCEUSND_LoadState(FCEU_VERSION_NUMERIC);
+  return FCEUMOV_PostLoad();
+}
+
+bool FCEUSS_LoadFlat(std::vector<uint8> *in) {
+  if (!FCEUSS_IsFlat(in))
+    return FCEUSS_LoadRAW(in);
+  return FCEUSS_LoadFlatMem(&(*in)[0], in->size());
+}
+
+bool FCEUSS_LoadFlatMem(const uint8 *in, uint32 size) {
+  if (!flatvalid) BuildFlatLayout();
+  uint32 magic, sig;
+  if (size != FLAT_HEADER + flatsize) return false;
+  memcpy(&magic, in, 4);
+  memcpy(&sig, in + 4, 4);
+  if (magic != FLAT_MAGIC || sig != flatsig) return false;
+
+  FCEUMOV_PreLoad();
+  FCEUSS_MarkAllDirty();
+
+  const uint8 *p = in + FLAT_HEADER;
+  for (int i = 0; i < flatfields.size(); i++) {
+    if (flatfields[i].dst != NULL)
+      memcpy(FieldPtr(flatfields[i].dst), p, flatfields[i].size);
+    p += flatfields[i].size;
+  }
+
+  return FinishFlatLoad();
+}
+
+// Delta-coded flat states. The flat state is XORed with a basis (as
+// if padded with zeros) and written as a series of ops, each a varint
+// (length - 1) << 2 | kind:
+//   DELTA_SAME: the next length bytes are the basis's.
+//   DELTA_XOR: length bytes follow, each XORed with the basis.
+//   DELTA_FILL: one byte follows, repeated length times.
+// States from nearby frames are mostly equal to a basis from the same
+// game, so this is mostly DELTA_SAME, and both directions are single
+// passes with no tables. Loading writes straight into the fields.
+enum { DELTA_SAME = 0, DELTA_XOR = 1, DELTA_FILL = 2 };
+// Shorter runs are cheaper as part of a DELTA_XOR.
+static const uint32 DELTA_MIN_SAME = 4, DELTA_MIN_FILL = 8;
+
+static vector<uint8> deltacur, deltabasis, deltaout;
+
+static inline uint8 *PutDeltaOp(uint8 *p, uint32 kind, uint32 len) {
+  uint32 c = ((len - 1) << 2) | kind;
+  while (c >= 0x80) {
+    *p++ = 0x80 | (c & 0x7F);
+    c >>= 7;
+  }
+  *p++ = c;
+  return p;
+}
+
+static inline bool IsFillAt(const uint8 *cur, uint32 i, uint32 n) {
+  if (i + DELTA_MIN_FILL > n) return false;
+  for (uint32 k = 1; k < DELTA_MIN_FILL; k++)
+    if (cur[i + k] != cur[i]) return false;
+  return true;
+}
+
+static inline bool IsSameAt(const uint8 *cur, const uint8 *b,
+                            uint32 i, uint32 n) {
+  if (i + DELTA_MIN_SAME > n) return false;
+  uint32 x, y;  // DELTA_MIN_SAME bytes.
+  memcpy(&x, cur + i, 4);
+  memcpy(&y, b + i, 4);
+  return x == y;
+}
+
+void FCEUSS_EncodeDelta(const uint8 *cur, uint32 n,
+                        const uint8 *basis, uint32 basissize,
+                        std::vector<uint8> *out) {
+  const uint8 *b = basis;
+  if (basissize < n) {
+    deltabasis.assign(n, 0);
+    if (basissize > 0) memcpy(&deltabasis[0], basis, basissize);
+    b = &deltabasis[0];
+  }
+
+  // Worst case is all DELTA_XOR, with an op every time a short
+  // DELTA_SAME or DELTA_FILL run interrupts it. Coded into a scratch
+  // buffer so that out doesn't keep that much capacity.
+  deltaout.resize(n + n / DELTA_MIN_SAME * 5 + 16);
+  uint8 *const begin = &deltaout[0];
+  uint8 *p = begin;
+
+  uint32 i = 0;
+  while (i < n) {
+    // Mostly long runs, so compare a word at a time.
+    uint32 j = i;
+    for (; j + 8 <= n; j += 8) {
+      uint64 x, y;
+      memcpy(&x, cur + j, 8);
+      memcpy(&y, b + j, 8);
+      if (x != y) break;
+    }
+    while (j < n && cur[j] == b[j]) j++;
+    if (j > i) {
+      p = PutDeltaOp(p, DELTA_SAME, j - i);
+      i = j;
+      continue;
+    }
+
+    if (IsFillAt(cur, i, n)) {
+      j = i + DELTA_MIN_FILL;
+      while (j < n && cur[j] == cur[i]) j++;
+      p = PutDeltaOp(p, DELTA_FILL, j - i);
+      *p++ = cur[i];
+      i = j;
+      continue;
+    }
+
+    j = i + 1;
+    while (j < n && !IsSameAt(cur, b, j, n) &&
+           !(cur[j] == cur[j - 1] && IsFillAt(cur, j, n)))
+      j++;
+    p = PutDeltaOp(p, DELTA_XOR, j - i);
+    for (; i < j; i++) *p++ = cur[i] ^ b[i];
+  }
+
+  out->insert(out->end(), begin, p);
+}
+
+bool FCEUSS_SaveFlatDelta(std::vector<uint8> *out,
+                          const uint8 *basis, uint32 basissize) {
+  if (!FCEUSS_SaveFlat(&deltacur)) return false;
+  FCEUSS_EncodeDelta(&deltacur[0], deltacur.size(), basis, basissize, out);
+  return true;
+}
+
+namespace {
+// Hands out where the bytes of a flat state go when it's loaded, in
+// order. The header goes to a buffer of its own and is checked before
+// anything is written to the fields.
+struct FlatSink {
+  FlatSink() : field(-1), left(FLAT_HEADER), dst(header), offset(0) {}
+
+  // Takes up to n bytes from the current field, returning false at
+  // the end of the state or if the header is wrong. *d is NULL if the
+  // bytes should be skipped, and *off is their offset in the state.
+  bool Next(uint32 n, uint8 **d, uint32 *len, uint32 *off) {
+    while (left == 0) {
+      if (field < 0) {
+        uint32 magic, sig;
+        memcpy(&magic, header, 4);
+        memcpy(&sig, header + 4, 4);
+        if (magic != FLAT_MAGIC || sig != flatsig) return false;
+        FCEUMOV_PreLoad();
+        FCEUSS_MarkAllDirty();
+      }
+      field++;
+      if (field >= (int)flatfields.size()) return false;
+      left = flatfields[field].size;
+      dst = flatfields[field].dst == NULL ? NULL :
+        FieldPtr(flatfields[field].dst);
+    }
+    *len = n < left ? n : left;
+    *d = dst;
+    *off = offset;
+    if (dst != NULL) dst += *len;
+    left -= *len;
+    offset += *len;
+    return true;
+  }
+
+  bool Done() const {
+    return offset == FLAT_HEADER + flatsize;
+  }
+
+  uint8 header[FLAT_HEADER];
+  int field;
+  uint32 left;
+  uint8 *dst;
+  uint32 offset;
+};
+}
+
+// Decodes into the bytes that sink hands out, as FlatSink does.
+template<class Sink>
+static bool DecodeDelta(const uint8 *in, uint32 size,
+                        const uint8 *basis, uint32 basissize,
+                        Sink *sink) {
+  const uint8 *end = in + size;
+  while (in < end) {
+    uint32 c = 0;
+    for (int shift = 0; ; shift += 7) {
+      if (in == end || shift > 28) return false;
+      const uint8 v = *in++;
+      c |= (uint32)(v & 0x7F) << shift;
+      if (!(v & 0x80)) break;
+    }
+    const uint32 kind = c & 3;
+    uint32 n = (c >> 2) + 1;
+    if (kind == DELTA_FILL && in == end) return false;
+    const uint8 fill = kind == DELTA_FILL ? *in++ : 0;
+    if (kind == DELTA_XOR && (uint32)(end - in) < n) return false;
+
+    while (n > 0) {
+      uint8 *d;
+      uint32 len, off;
+      if (!sink->Next(n, &d, &len, &off)) return false;
+      n -= len;
+      switch (kind) {
+      case DELTA_SAME:
+        if (d != NULL) {
+          const uint32 blen =
+            off >= basissize ? 0 : std::min(len, basissize - off);
+          if (blen > 0) memcpy(d, basis + off, blen);
+          if (blen < len) memset(d + blen, 0, len - blen);
+        }
+        break;
+      case DELTA_XOR:
+        if (d != NULL) {
+          for (uint32 k = 0; k < len; k++)
+            d[k] = in[k] ^ (off + k < basissize ? basis[off + k] : 0);
+        }
+        in += len;
+        break;
+      case DELTA_FILL:
+        if (d != NULL) memset(d, fill, len);
+        break;
+      default:
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+namespace {
+// Appends to a vector.
+struct BufferSink {
+  explicit BufferSink(std::vector<uint8> *out) : out(out) {}
+  bool Next(uint32 n, uint8 **d, uint32 *len, uint32 *off) {
+    *off = out->size();
+    out->resize(*off + n);
+    *d = &(*out)[*off];
+    *len = n;
+    return true;
+  }
+  std::vector<uint8> *out;
+};
+}
+
+bool FCEUSS_DecodeDelta(const uint8 *in, uint32 size,
+                        const uint8 *basis, uint32 basissize,
+                        std::vector<uint8> *out) {
+  out->clear();
+  BufferSink sink(out);
+  return DecodeDelta(in, size, basis, basissize, &sink);
+}
+
+bool FCEUSS_LoadFlatDelta(const uint8 *in, uint32 size,
+                          const uint8 *basis, uint32 basissize) {
+  if (!flatvalid) BuildFlatLayout();
+
+  FlatSink sink;
+  if (!DecodeDelta(in, size, basis, basissize, &sink)) return false;
+  if (!sink.Done()) return false;
+  return FinishFlatLoad();
+}
+
+// Dirty tracking for MarkBase/RestoreBase. The first two regions
+// are CPU RAM and nametable RAM; the rest belong to the mapper and
+// go away in ResetExState.
+namespace {
+struct DirtyRegion {
+  uint8 *v;
+  uint32 size;
+  // One byte per block of FCEUSS_DIRTY_* bits: the block may differ
+  // from the base, or from when it was last fingerprinted.
+  uint8 *blocks;
+  bool owned;
+};
+
+// A field of the base state and where it goes when restored.
+struct BaseField {
+  uint8 *dst;
+  uint32 offset;
+  uint32 size;
+  // Index into dirtyregions, or -1 to always copy the whole field.
+  int region;
+};
+}
+
+uint8 RAMDirty[0x800 >> FCEUSS_DIRTY_SHIFT];
+static uint8 NTARAMDirty[0x800 >> FCEUSS_DIRTY_SHIFT];
+static vector<DirtyRegion> dirtyregions;
+
+static vector<uint8> basestate;
+static vector<BaseField> basefields;
+static bool basevalid = false;
+static bool printvalid = false;
+
+static const uint32 DIRTY_BLOCK = 1 << FCEUSS_DIRTY_SHIFT;
+
+static inline uint32 DirtyBlocks(uint32 size) {
+  return (size + DIRTY_BLOCK - 1) >> FCEUSS_DIRTY_SHIFT;
+}
+
+static void AddDirtyRegion(uint8 *v, uint32 size, uint8 *blocks) {
+  DirtyRegion r;
+  r.v = v;
+  r.size = size;
+  r.owned = blocks == NULL;
+  r.blocks = r.owned ? (uint8 *)malloc(DirtyBlocks(size)) : blocks;
+  // Nothing is known to match a base yet.
+  memset(r.blocks, FCEUSS_DIRTY_ALL, DirtyBlocks(size));
+  dirtyregions.push_back(r);
+  basevalid = false;
+  printvalid = false;
+}
+
+static void ResetDirtyRegions() {
+  for (int i = 0; i < dirtyregions.size(); i++)
+    if (dirtyregions[i].owned) free(dirtyregions[i].blocks);
+  dirtyregions.clear();
+  if (RAM != NULL) AddDirtyRegion(RAM, 0x800, RAMDirty);
+  AddDirtyRegion(NTARAM, 0x800, NTARAMDirty);
+}
+
+void FCEUSS_TrackDirty(uint8 *v, uint32 size) {
+  AddDirtyRegion(v, size, NULL);
+}
+
+void FCEUSS_MarkDirty(const uint8 *p) {
+  for (int i = 0; i < dirtyregions.size(); i++) {
+    const DirtyRegion &r = dirtyregions[i];
+    uintptr_t off = (uintptr_t)p - (uintptr_t)r.v;
+    if (off < r.size) {
+      r.blocks[off >> FCEUSS_DIRTY_SHIFT] = FCEUSS_DIRTY_ALL;
+      return;
+    }
+  }
+}
+
+void FCEUSS_MarkAllDirty(void) {
+  for (int i = 0; i < dirtyregions.size(); i++)
+    memset(dirtyregions[i].blocks, FCEUSS_DIRTY_ALL,
+           DirtyBlocks(dirtyregions[i].size));
+}
+
+bool FCEUSS_MarkBase(void) {
+  FCEUSS_SaveFlat(&basestate);
+
+  basefields.clear();
+  uint32 offset = FLAT_HEADER;
+  for (int i = 0; i < flatfields.size(); i++) {
+    const FlatField &f = flatfields[i];
+    if (f.dst != NULL) {
+      BaseField b;
+      b.dst = FieldPtr(f.dst);
+      b.offset = offset;
+      b.size = f.size;
+      b.region = -1;
+      // Only if the field loads back into itself; otherwise the
+      // memory can differ from its saved copy without being written.
+      if (f.dst == f.src) {
+        for (int r = 0; r < dirtyregions.size(); r++) {
+          if (dirtyregions[r].v == b.dst && dirtyregions[r].size == b.size)
+            b.region = r;
+        }
+      }
+      // Globals saved one after another are often next to each
+      // other in memory too; copy them in one go.
+      if (b.region < 0 && !basefields.empty()) {
+        BaseField &last = basefields.back();
+        if (last.region < 0 &&
+            last.dst + last.size == b.dst &&
+            last.offset + last.size == b.offset) {
+          last.size += b.size;
+          offset += f.size;
+          continue;
+        }
+      }
+      basefields.push_back(b);
+    }
+    offset += f.size;
+  }
+
+  for (int i = 0; i < dirtyregions.size(); i++) {
+    uint8 *blocks = dirtyregions[i].blocks;
+    const uint32 nblocks = DirtyBlocks(dirtyregions[i].size);
+    for (uint32 b = 0; b < nblocks; b++) blocks[b] &= ~FCEUSS_DIRTY_BASE;
+  }
+  basevalid = true;
+  return true;
+}
+
+bool FCEUSS_RestoreBase(void) {
+  if (!basevalid) return false;
+
+  FCEUMOV_PreLoad();
+
+  const uint8 *base = &basestate[0];
+  for (int i = 0; i < basefields.size(); i++) {
+    const BaseField &f = basefields[i];
+    if (f.region < 0) {
+      // Most fields are single variables.
+      switch (f.size) {
+      case 1: *f.dst = base[f.offset]; break;
+      case 2: memcpy(f.dst, base + f.offset, 2); break;
+      case 4: memcpy(f.dst, base + f.offset, 4); break;
+      default: memcpy(f.dst, base + f.offset, f.size); break;
+      }
+      continue;
+    }
+    // Copy each run of dirty blocks at once. That changes them since
+    // they were last fingerprinted, of course.
+    uint8 *blocks = dirtyregions[f.region].blocks;
+    const uint32 nblocks = DirtyBlocks(f.size);
+    for (uint32 b = 0; b < nblocks; b++) {
+      if (!(blocks[b] & FCEUSS_DIRTY_BASE)) continue;
+      uint32 e = b;
+      while (e < nblocks && (blocks[e] & FCEUSS_DIRTY_BASE))
+        blocks[e++] = FCEUSS_DIRTY_PRINT;
+      const uint32 start = b << FCEUSS_DIRTY_SHIFT;
+      const uint32 end = std::min(e << FCEUSS_DIRTY_SHIFT, f.size);
+      memcpy(f.dst + start, base + f.offset + start, end - start);
+      b = e;
+    }
+  }
+
+  return FinishFlatLoad();
+}
+
+// Fingerprints. The buffer that gets hashed is the untracked fields,
+// copied in the same order as a flat state, followed by a 64-bit hash
+// of each block of the tracked regions. Block hashes are kept in
+// place, and only redone for blocks with FCEUSS_DIRTY_PRINT set.
+namespace {
+struct PrintField {
+  uint8 *src;
+  uint32 size;
+  // Where the bytes (or block hashes) go in printbuf.
+  uint32 offset;
+  // Index into dirtyregions, or -1 to copy the field every time.
+  int region;
+};
+}
+
+static vector<uint8> printbuf;
+static vector<PrintField> printfields;
+// Untracked fields from the SFMDATA section on, which need the
+// SPreSave/SPostSave hooks around them.
+static uint32 printexstart = 0;
+
+static void BuildPrintLayout() {
+  if (!flatvalid) BuildFlatLayout();
+
+  printfields.clear();
+  printexstart = 0;
+  uint32 offset = 0;
+  for (int i = 0; i < flatfields.size(); i++) {
+    const FlatField &f = flatfields[i];
+    if (i == flatexstart) printexstart = printfields.size();
+    PrintField p;
+    p.src = FieldPtr(f.src);
+    p.size = f.size;
+    p.offset = offset;
+    p.region = -1;
+    for (int r = 0; r < dirtyregions.size(); r++) {
+      if (dirtyregions[r].v == p.src && dirtyregions[r].size == p.size)
+        p.region = r;
+    }
+    if (p.region >= 0) {
+      offset += DirtyBlocks(p.size) * sizeof (uint64);
+      // Hash everything the first time.
+      memset(dirtyregions[p.region].blocks, FCEUSS_DIRTY_ALL,
+             DirtyBlocks(p.size));
+    } else {
+      offset += p.size;
+      // As in MarkBase, merge neighbors in memory, but not across
+      // the hooks.
+      if (!printfields.empty() && i != flatexstart) {
+        PrintField &last = printfields.back();
+        if (last.region < 0 && last.src + last.size == p.src) {
+          last.size += p.size;
+          continue;
+        }
+      }
+    }
+    printfields.push_back(p);
+  }
+  if (flatexstart == flatfields.size()) printexstart = printfields.size();
+  printbuf.resize(offset);
+  printvalid = true;
+}
+
+static inline void CopyPrintField(const PrintField &f) {
+  uint8 *out = &printbuf[f.offset];
+  if (f.region < 0) {
+    memcpy(out, f.src, f.size);
+    return;
+  }
+  uint8 *blocks = dirtyregions[f.region].blocks;
+  const uint32 nblocks = DirtyBlocks(f.size);
+  for (uint32 b = 0; b < nblocks; b++) {
+    if (!(blocks[b] & FCEUSS_DIRTY_PRINT)) continue;
+    blocks[b] &= ~FCEUSS_DIRTY_PRINT;
+    const uint32 start = b << FCEUSS_DIRTY_SHIFT;
+    const uint32 len = std::min(DIRTY_BLOCK, f.size - start);
+    const uint64 h = CityHash64((const char *)f.src + start, len);
+    memcpy(out + b * sizeof (uint64), &h, sizeof (uint64));
+  }
+}
+
+void FCEUSS_Fingerprint(uint64 *lo, uint64 *hi) {
+  if (!printvalid || !flatvalid) BuildPrintLayout();
+
+  // Same preparation as SaveFlat.
+  FCEUPPU_SaveState();
+  FCEUSND_SaveState();
+
+  for (uint32 i = 0; i < printexstart; i++)
+    CopyPrintField(printfields[i]);
+  if(SPreSave) SPreSave();
+  for (uint32 i = printexstart; i < printfields.size(); i++)
+    CopyPrintField(printfields[i]);
+  if(SPreSave) SPostSave();
+
+  const uint128 h = CityHash128((const char *)&printbuf[0], printbuf.size());
+  *lo = Uint128Low64(h);
+  *hi = Uint128High64(h);
+}
+
 // XXX ger rid of this? -tom7
 bool FCEUSS_SaveMS(EMUFILE* outstream, int compressionLevel, std::vector<uint8> *basis)
 {
@@ -615,6 +1353,7 @@ bool FCEUSS_LoadFP(EMUFILE* is, ENUM_SSLOADPARAMS params, std::vector<uint8> *ba
   }
 
   FCEUMOV_PreLoad();
+  FCEUSS_MarkAllDirty();
 
   bool x = (ReadStateChunks(&memory_savestate, totalsize) != 0);
 
@@ -746,6 +1485,17 @@ void FCEUSS_CheckStates(void)
 	StateShow=0;
 }
 
+void FCEUSS_SetProfile(int profile) {
+  flatprofile = profile;
+  flatvalid = false;
+  basevalid = false;
+  printvalid = false;
+}
+
+int FCEUSS_GetProfile(void) {
+  return flatprofile;
+}
+
 void ResetExState(void (*PreSave)(void), void (*PostSave)(void))
 {
 	int x;
@@ -760,6 +1510,10 @@ void ResetExState(void (*PreSave)(void), void (*PostSave)(void))
 	SPreSave = PreSave;
 	SPostSave = PostSave;
 	SFEXINDEX=0;
+	flatvalid = false;
+	basevalid = false;
+	printvalid = false;
+	ResetDirtyRegions();
 }
 
 void AddExState(void *v, uint32 s, int type, char *desc) {
@@ -805,6 +1559,9 @@ void AddExState(void *v, uint32 s, int type, char *desc) {
     }
   }
   SFMDATA[SFEXINDEX].v=0;		// End marker.
+  flatvalid = false;
+  basevalid = false;
+  printvalid = false;
 }
 
 void FCEUI_SelectStateNext(int n)
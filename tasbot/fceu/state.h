@@ -57,6 +57,78 @@ struct SFORMAT
 // Tom 7's simplified versions. These should only be used for in-memory saves!
 bool FCEUSS_SaveRAW(std::vector<uint8> *out);
 bool FCEUSS_LoadRAW(std::vector<uint8> *in);
+// Faster still: fields copied back to back with no tags. Only
+// loadable by the same build with the same game loaded. LoadFlat
+// also accepts SaveRAW states.
+bool FCEUSS_SaveFlat(std::vector<uint8> *out);
+bool FCEUSS_LoadFlat(std::vector<uint8> *in);
+bool FCEUSS_IsFlat(const std::vector<uint8> *in);
+uint32 FCEUSS_FlatSize(void);
+// The same, from memory. Only flat states, not SaveRAW ones.
+bool FCEUSS_LoadFlatMem(const uint8 *in, uint32 size);
+// Which fields flat states (and everything built on them: deltas,
+// MarkBase and fingerprints) have. FULL is all of them, like the
+// tagged formats, which never change. SEARCH leaves out the ones
+// nothing the game can see depends on (sound output, the new PPU's
+// state when it's not in use, UI counters), so states that only
+// differ there are the same state. The layout depends on the
+// profile, so flat states made in one can't be loaded in the other.
+#define FCEUSS_PROFILE_FULL 0
+#define FCEUSS_PROFILE_SEARCH 1
+void FCEUSS_SetProfile(int profile);
+int FCEUSS_GetProfile(void);
+// Offsets where a flat state can be cut into pieces that tend to
+// change independently: the start of each SFORMAT table, and around
+// and within big fields (like RAM), every FCEUSS_FLAT_CHUNK bytes.
+// The first is always 0. Same layout caveats as above.
+#define FCEUSS_FLAT_CHUNK 256
+void FCEUSS_FlatChunks(std::vector<uint32> *starts);
+// A flat state coded as its difference from a basis (any bytes; best
+// is a flat state of the same game), with runs of equal and repeated
+// bytes as counts. Much faster than zlib, though bigger. Save appends
+// to out. Load decodes straight into the emulator, with the same
+// basis, and returns false if the data is bad.
+bool FCEUSS_SaveFlatDelta(std::vector<uint8> *out,
+                          const uint8 *basis, uint32 basissize);
+bool FCEUSS_LoadFlatDelta(const uint8 *in, uint32 size,
+                          const uint8 *basis, uint32 basissize);
+// The same coding for any bytes, like states that aren't loaded.
+// Encode appends to out; Decode replaces it.
+void FCEUSS_EncodeDelta(const uint8 *in, uint32 size,
+                        const uint8 *basis, uint32 basissize,
+                        std::vector<uint8> *out);
+bool FCEUSS_DecodeDelta(const uint8 *in, uint32 size,
+                        const uint8 *basis, uint32 basissize,
+                        std::vector<uint8> *out);
+
+// Restoring the same state over and over (as search does) only needs
+// to copy back what changed. MarkBase saves a flat state as the base;
+// RestoreBase loads it again, but for memory registered with
+// FCEUSS_TrackDirty only copies the 64-byte blocks written since.
+// That means every write to tracked memory has to be marked, with
+// FCEUSS_MarkDirty or (for CPU RAM, in the hot paths) RAMDirty.
+// CPU RAM and nametable RAM are always tracked; mappers can add more
+// after ResetExState. Any other kind of load marks everything dirty.
+// RestoreBase returns false if there's no base for the current layout.
+#define FCEUSS_DIRTY_SHIFT 6
+// A write sets all the bits of its block's byte; MarkBase clears
+// FCEUSS_DIRTY_BASE and FCEUSS_Fingerprint clears FCEUSS_DIRTY_PRINT.
+#define FCEUSS_DIRTY_BASE 1
+#define FCEUSS_DIRTY_PRINT 2
+#define FCEUSS_DIRTY_ALL 0xFF
+extern uint8 RAMDirty[0x800 >> FCEUSS_DIRTY_SHIFT];
+void FCEUSS_TrackDirty(uint8 *v, uint32 size);
+void FCEUSS_MarkDirty(const uint8 *p);
+void FCEUSS_MarkAllDirty(void);
+bool FCEUSS_MarkBase(void);
+bool FCEUSS_RestoreBase(void);
+
+// 128-bit hash of everything SaveFlat would save, so equal states get
+// equal fingerprints. Tracked memory is hashed in blocks using the
+// same dirty bytes as above, and only blocks written since the last
+// call are hashed again, which makes this much cheaper than saving
+// the state and hashing that.
+void FCEUSS_Fingerprint(uint64 *lo, uint64 *hi);
 
 void ResetExState(void (*PreSave)(void),void (*PostSave)(void));
 void AddExState(void *v, uint32 s, int type, char *desc);
@@ -24,6 +24,9 @@
 #include "fceu.h"
 #include "debug.h"
 #include "sound.h"
+#include "cart.h"
+#include "state.h"
+#include "driver.h"
 #ifdef _S9XLUA_H
 #include "fceulua.h"
 #endif
@@ -42,30 +45,52 @@ void (*MapIRQHook)(int a);
 }
 
 //normal memory read
+//RAM and plain cartridge pages are read directly, without calling
+//the handler; see FastReadPage.
 static INLINE uint8 RdMem(unsigned int A)
 {
+ switch(FastReadPage[A>>11])
+ {
+  case FASTMEM_RAM: return(_DB=RAM[A&0x7FF]);
+  case FASTMEM_CART: return(_DB=Page[A>>11][A]);
+ }
  return(_DB=ARead[A](A));
 }
 
 //normal memory write
 static INLINE void WrMem(unsigned int A, uint8 V)
 {
-	BWrite[A](A,V);
+	if(FastWritePage[A>>11]==FASTMEM_RAM)
+		FCEU_WriteRAM(A&0x7FF,V);
+	else
+		BWrite[A](A,V);
 	#ifdef _S9XLUA_H
 	CallRegisteredLuaMemHook(A, 1, V, LUAMEMHOOK_WRITE);
 	#endif
 }
 
+//instruction fetch
+//Code nearly always runs from a plain cartridge page, so that case is
+//inlined here; anything else (RAM, handlers) goes through RdMem.
+static INLINE uint8 RdOp(unsigned int A)
+{
+ if(FastReadPage[A>>11]==FASTMEM_CART)
+  return(_DB=Page[A>>11][A]);
+ return RdMem(A);
+}
+
 static INLINE uint8 RdRAM(unsigned int A)
 {
   //bbit edited: this was changed so cheat substituion would work
+  if(FastReadPage[0]==FASTMEM_RAM)
+    return(_DB=RAM[A]);
   return(_DB=ARead[A](A));
   // return(_DB=RAM[A]);
 }
 
 static INLINE void WrRAM(unsigned int A, uint8 V)
 {
-	RAM[A]=V;
+	FCEU_WriteRAM(A,V);
 	#ifdef _S9XLUA_H
 	CallRegisteredLuaMemHook(A, 1, V, LUAMEMHOOK_WRITE);
 	#endif
@@ -95,6 +120,19 @@ void X6502_DMW(uint32 A, uint8 V)
 
 #define POP() RdRAM(0x100+(++_S))
 
+/* Opcode dispatch.  ops.inc marks each opcode with OP().  If
+   FCEU_COMPUTED_GOTO is defined (GCC only), that also makes a label and
+   X6502_Run jumps through a table of their addresses instead of going
+   through the switch.  It's off by default because it measured no
+   faster; the switch already compiles to a jump table and the
+   per-instruction bookkeeping dominates. */
+#if defined(__GNUC__) && defined(FCEU_COMPUTED_GOTO)
+#define X6502_COMPUTED_GOTO
+#define OP(n) case n: op_##n
+#else
+#define OP(n) case n
+#endif
+
 static uint8 ZNTable[256];
 /* Some of these operations will only make sense if you know what the flag
    constants are. */
@@ -102,19 +140,23 @@ static uint8 ZNTable[256];
 #define X_ZN(zort)      _P&=~(Z_FLAG|N_FLAG);_P|=ZNTable[zort]
 #define X_ZNT(zort)  _P|=ZNTable[zort]
 
+static void IdleLoop(uint32 from);
+
 #define JR(cond);  \
 {    \
  if(cond)  \
  {  \
   uint32 tmp;  \
   int32 disp;  \
-  disp=(int8)RdMem(_PC);  \
+  disp=(int8)RdOp(_PC);  \
   _PC++;  \
   ADDCYC(1);  \
   tmp=_PC;  \
   _PC+=disp;  \
   if((tmp^_PC)&0x100)  \
   ADDCYC(1);  \
+  if(disp<0)  \
+  IdleLoop((tmp-2)&0xFFFF);  \
  }  \
  else _PC++;  \
 }
@@ -202,9 +244,9 @@ static uint8 ZNTable[256];
 /* Absolute */
 #define GetAB(target)   \
 {  \
- target=RdMem(_PC);  \
+ target=RdOp(_PC);  \
  _PC++;  \
- target|=RdMem(_PC)<<8;  \
+ target|=RdOp(_PC)<<8;  \
  _PC++;  \
 }
 
@@ -237,14 +279,14 @@ static uint8 ZNTable[256];
 /* Zero Page */
 #define GetZP(target)  \
 {  \
- target=RdMem(_PC);   \
+ target=RdOp(_PC);   \
  _PC++;  \
 }
 
 /* Zero Page Indexed */
 #define GetZPI(target,i)  \
 {  \
- target=i+RdMem(_PC);  \
+ target=i+RdOp(_PC);  \
  _PC++;  \
 }
 
@@ -252,7 +294,7 @@ static uint8 ZNTable[256];
 #define GetIX(target)  \
 {  \
  uint8 tmp;  \
- tmp=RdMem(_PC);  \
+ tmp=RdOp(_PC);  \
  _PC++;  \
  tmp+=_X;  \
  target=RdRAM(tmp);  \
@@ -265,7 +307,7 @@ static uint8 ZNTable[256];
 {  \
  unsigned int rt;  \
  uint8 tmp;  \
- tmp=RdMem(_PC);  \
+ tmp=RdOp(_PC);  \
  _PC++;  \
  rt=RdRAM(tmp);  \
  tmp++;  \
@@ -285,7 +327,7 @@ static uint8 ZNTable[256];
 {  \
  unsigned int rt;  \
  uint8 tmp;  \
- tmp=RdMem(_PC);  \
+ tmp=RdOp(_PC);  \
  _PC++;  \
  rt=RdRAM(tmp);  \
  tmp++;  \
@@ -311,7 +353,7 @@ static uint8 ZNTable[256];
 #define RMW_ZP(op)  {uint8 A; uint8 x; GetZP(A); x=RdRAM(A); op; WrRAM(A,x); break; }
 #define RMW_ZPX(op) {uint8 A; uint8 x; GetZPI(A,_X); x=RdRAM(A); op; WrRAM(A,x); break;}
 
-#define LD_IM(op)  {uint8 x; x=RdMem(_PC); _PC++; op; break;}
+#define LD_IM(op)  {uint8 x; x=RdOp(_PC); _PC++; op; break;}
 #define LD_ZP(op)  {uint8 A; uint8 x; GetZP(A); x=RdRAM(A); op; break;}
 #define LD_ZPX(op)  {uint8 A; uint8 x; GetZPI(A,_X); x=RdRAM(A); op; break;}
 #define LD_ZPY(op)  {uint8 A; uint8 x; GetZPI(A,_Y); x=RdRAM(A); op; break;}
@@ -372,6 +414,178 @@ void TriggerNMI2(void)
  _IRQlow|=FCEU_IQNMI2;
 }
 
+/* Idle loop fast-forward.  Lots of games wait for the NMI in a loop
+   like "wait: LDA frame / CMP last / BEQ wait" that only reads memory.
+   Once such a loop has gone around once with the registers coming back
+   the same and nothing else happening (the timestamp advanced by exactly
+   the loop's own cycle count, so no interrupt or DMA), every later
+   iteration will do the same thing until some event that isn't the
+   CPU's: the end of this X6502_Run chunk, a sound hook event, or an
+   interrupt.  So we can jump straight to the last iteration before
+   the earliest of those.  This is exact; the saved state is identical
+   to running the loop.
+
+   Loops that read anything but RAM, PRG-RAM or PRG-ROM (e.g. polling
+   $2002 for sprite 0 hit, which can change mid-chunk) are not skipped.
+   The snapshot is forgotten at the start of each X6502_Run, since the
+   PPU, mapper or a state load can change memory in between. */
+static bool idleskip=true;
+static uint64 idlerequested=0, idleskipped=0, idleloops=0;
+static struct {
+ uint32 from, to;
+ uint8 A,X,Y,S,P;
+ uint32 ts;
+ int32 cycles;   /* per iteration; 0 if not skippable, -1 if unknown */
+} idle;
+
+static INLINE bool CodeInROM(uint32 A)
+{
+ return FastReadPage[A>>11]==FASTMEM_CART && CartPageIsROM(A);
+}
+
+/* Returns the cycles that one iteration of the loop from head to the
+   backwards JMP/Bxx at tail takes, or 0 if the loop does anything
+   other than read plain memory into registers.  Sets *rom to whether
+   all of the loop's code is in PRG-ROM, i.e. whether the answer holds
+   until PRGMapGeneration changes. */
+static int32 IdleLoopCycles(uint32 head, uint32 tail, bool *rom)
+{
+ uint32 pc=head;
+ int32 cycles=0;
+ *rom=true;
+ for(int n=0;n<16 && pc<=tail;n++)
+ {
+  if(!FCEU_IsPlainRead(pc)) return 0;
+  if(!CodeInROM(pc) || !CodeInROM((pc+2)&0xFFFF)) *rom=false;
+  uint8 op=ARead[pc](pc);
+  int size=opsize[op];
+  if(!size) return 0;
+  for(int i=1;i<size;i++)
+   if(!FCEU_IsPlainRead((pc+i)&0xFFFF)) return 0;
+  uint32 arg=0;
+  if(size>1) arg=ARead[(pc+1)&0xFFFF]((pc+1)&0xFFFF);
+  if(size>2) arg|=ARead[(pc+2)&0xFFFF]((pc+2)&0xFFFF)<<8;
+
+  if(pc==tail)
+  {
+   switch(op)
+   {
+    case 0x10: case 0x30: case 0x50: case 0x70:
+    case 0x90: case 0xB0: case 0xD0: case 0xF0:
+     if(((pc+2+(int8)arg)&0xFFFF)!=head) return 0;
+     return cycles+3+((((pc+2)^head)&0x100)?1:0);
+    case 0x4C:
+     if(arg!=head) return 0;
+     return cycles+3;
+   }
+   return 0;
+  }
+
+  switch(op)
+  {
+   /* Implied and accumulator. */
+   case 0xEA: case 0x18: case 0x38: case 0xD8: case 0xF8: case 0xB8:
+   case 0xAA: case 0x8A: case 0xA8: case 0x98: case 0xBA: case 0x9A:
+   case 0xE8: case 0xC8: case 0xCA: case 0x88:
+   case 0x0A: case 0x4A: case 0x2A: case 0x6A:
+   /* Immediate. */
+   case 0xA9: case 0xA2: case 0xA0: case 0xC9: case 0xE0: case 0xC0:
+   case 0x29: case 0x09: case 0x49: case 0x69: case 0xE9:
+    break;
+   /* Zero page and absolute reads. */
+   case 0xA5: case 0xA6: case 0xA4: case 0xC5: case 0xE4: case 0xC4:
+   case 0x25: case 0x05: case 0x45: case 0x65: case 0xE5: case 0x24:
+   case 0xAD: case 0xAE: case 0xAC: case 0xCD: case 0xEC: case 0xCC:
+   case 0x2D: case 0x0D: case 0x4D: case 0x6D: case 0xED: case 0x2C:
+    if(!FCEU_IsPlainRead(arg)) return 0;
+    break;
+   default:
+    return 0;
+  }
+  cycles+=CycTable[op];
+  pc+=size;
+ }
+ return 0;
+}
+
+/* Decoded loops, so that we don't decode the same one at the start of
+   every X6502_Run chunk.  Only loops entirely in PRG-ROM are kept, and
+   only until the PRG mapping changes; code in RAM can be rewritten
+   at any time, so it's decoded every time. */
+static struct {
+ uint32 head, tail, gen;
+ int32 cycles;
+} idleblocks[64];
+
+static int32 IdleLoopLookup(uint32 head, uint32 tail)
+{
+ int h=(head^(tail>>2))&63;
+ if(idleblocks[h].head==head && idleblocks[h].tail==tail &&
+    idleblocks[h].gen==PRGMapGeneration)
+  return idleblocks[h].cycles;
+
+ bool rom;
+ int32 cycles=IdleLoopCycles(head,tail,&rom);
+ if(rom)
+ {
+  idleblocks[h].head=head;
+  idleblocks[h].tail=tail;
+  idleblocks[h].gen=PRGMapGeneration;
+  idleblocks[h].cycles=cycles;
+ }
+ return cycles;
+}
+
+/* Called after a taken backwards branch or jump from the instruction
+   at from, with _PC already at the target. */
+static void IdleLoop(uint32 from)
+{
+ if(!idleskip) return;
+ if(idle.from!=from || idle.to!=_PC)
+ {
+  idle.from=from;
+  idle.to=_PC;
+  idle.cycles=-1;
+ }
+ else if(idle.A==_A && idle.X==_X && idle.Y==_Y && idle.S==_S && idle.P==_P &&
+         !MapIRQHook &&
+         (!_IRQlow || (!(_IRQlow&(FCEU_IQRESET|FCEU_IQNMI2|FCEU_IQNMI|FCEU_IQTEMP)) &&
+                       (_P&I_FLAG))))
+ {
+  if(idle.cycles<0)
+   idle.cycles=IdleLoopLookup(_PC,from);
+  if(idle.cycles>0 && timestamp-idle.ts==(uint32)idle.cycles)
+  {
+   int32 n=(_count-1)/(idle.cycles*48);
+   int32 s=FCEU_SoundIdleCycles()/idle.cycles;
+   if(s<n) n=s;
+   if(n>0)
+   {
+    int32 c=n*idle.cycles;
+    _count-=c*48;
+    timestamp+=c;
+    FCEU_SoundSkipCycles(c);
+    idleskipped+=c;
+    idleloops++;
+   }
+  }
+ }
+ idle.A=_A; idle.X=_X; idle.Y=_Y; idle.S=_S; idle.P=_P;
+ idle.ts=timestamp;
+}
+
+void FCEUI_SetIdleLoopSkip(bool skip)
+{
+ idleskip=skip;
+}
+
+void FCEUI_GetIdleLoopStats(uint64 *cycles, uint64 *skipped, uint64 *loops)
+{
+ *cycles=idlerequested/48;
+ *skipped=idleskipped;
+ *loops=idleloops;
+}
+
 void X6502_Reset(void)
 {
  _IRQlow=FCEU_IQRESET;
@@ -413,13 +627,37 @@ void X6502_Power(void)
 
 void X6502_Run(int32 cycles)
 {
+#ifdef X6502_COMPUTED_GOTO
+#define L(n) &&op_##n
+  static const void *const optable[256] = {
+   L(0x00),L(0x01),L(0x02),L(0x03),L(0x04),L(0x05),L(0x06),L(0x07),L(0x08),L(0x09),L(0x0A),L(0x0B),L(0x0C),L(0x0D),L(0x0E),L(0x0F),
+   L(0x10),L(0x11),L(0x12),L(0x13),L(0x14),L(0x15),L(0x16),L(0x17),L(0x18),L(0x19),L(0x1A),L(0x1B),L(0x1C),L(0x1D),L(0x1E),L(0x1F),
+   L(0x20),L(0x21),L(0x22),L(0x23),L(0x24),L(0x25),L(0x26),L(0x27),L(0x28),L(0x29),L(0x2A),L(0x2B),L(0x2C),L(0x2D),L(0x2E),L(0x2F),
+   L(0x30),L(0x31),L(0x32),L(0x33),L(0x34),L(0x35),L(0x36),L(0x37),L(0x38),L(0x39),L(0x3A),L(0x3B),L(0x3C),L(0x3D),L(0x3E),L(0x3F),
+   L(0x40),L(0x41),L(0x42),L(0x43),L(0x44),L(0x45),L(0x46),L(0x47),L(0x48),L(0x49),L(0x4A),L(0x4B),L(0x4C),L(0x4D),L(0x4E),L(0x4F),
+   L(0x50),L(0x51),L(0x52),L(0x53),L(0x54),L(0x55),L(0x56),L(0x57),L(0x58),L(0x59),L(0x5A),L(0x5B),L(0x5C),L(0x5D),L(0x5E),L(0x5F),
+   L(0x60),L(0x61),L(0x62),L(0x63),L(0x64),L(0x65),L(0x66),L(0x67),L(0x68),L(0x69),L(0x6A),L(0x6B),L(0x6C),L(0x6D),L(0x6E),L(0x6F),
+   L(0x70),L(0x71),L(0x72),L(0x73),L(0x74),L(0x75),L(0x76),L(0x77),L(0x78),L(0x79),L(0x7A),L(0x7B),L(0x7C),L(0x7D),L(0x7E),L(0x7F),
+   L(0x80),L(0x81),L(0x82),L(0x83),L(0x84),L(0x85),L(0x86),L(0x87),L(0x88),L(0x89),L(0x8A),L(0x8B),L(0x8C),L(0x8D),L(0x8E),L(0x8F),
+   L(0x90),L(0x91),L(0x92),L(0x93),L(0x94),L(0x95),L(0x96),L(0x97),L(0x98),L(0x99),L(0x9A),L(0x9B),L(0x9C),L(0x9D),L(0x9E),L(0x9F),
+   L(0xA0),L(0xA1),L(0xA2),L(0xA3),L(0xA4),L(0xA5),L(0xA6),L(0xA7),L(0xA8),L(0xA9),L(0xAA),L(0xAB),L(0xAC),L(0xAD),L(0xAE),L(0xAF),
+   L(0xB0),L(0xB1),L(0xB2),L(0xB3),L(0xB4),L(0xB5),L(0xB6),L(0xB7),L(0xB8),L(0xB9),L(0xBA),L(0xBB),L(0xBC),L(0xBD),L(0xBE),L(0xBF),
+   L(0xC0),L(0xC1),L(0xC2),L(0xC3),L(0xC4),L(0xC5),L(0xC6),L(0xC7),L(0xC8),L(0xC9),L(0xCA),L(0xCB),L(0xCC),L(0xCD),L(0xCE),L(0xCF),
+   L(0xD0),L(0xD1),L(0xD2),L(0xD3),L(0xD4),L(0xD5),L(0xD6),L(0xD7),L(0xD8),L(0xD9),L(0xDA),L(0xDB),L(0xDC),L(0xDD),L(0xDE),L(0xDF),
+   L(0xE0),L(0xE1),L(0xE2),L(0xE3),L(0xE4),L(0xE5),L(0xE6),L(0xE7),L(0xE8),L(0xE9),L(0xEA),L(0xEB),L(0xEC),L(0xED),L(0xEE),L(0xEF),
+   L(0xF0),L(0xF1),L(0xF2),L(0xF3),L(0xF4),L(0xF5),L(0xF6),L(0xF7),L(0xF8),L(0xF9),L(0xFA),L(0xFB),L(0xFC),L(0xFD),L(0xFE),L(0xFF),
+  };
+#undef L
+#endif
+
   if(PAL)
    cycles*=15;    // 15*4=60
   else
    cycles*=16;    // 16*4=64
 
   _count+=cycles;
-extern int test; test++;
+  idlerequested+=cycles;
+  idle.from=~0;
   while(_count>0)
   {
    int32 temp;
@@ -483,7 +721,7 @@ extern int test; test++;
    DEBUG( DebugCycle() );
 
    _PI=_P;
-   b1=RdMem(_PC);
+   b1=RdOp(_PC);
 
    ADDCYC(CycTable[b1]);
 
@@ -495,6 +733,9 @@ extern int test; test++;
    CallRegisteredLuaMemHook(_PC, 1, 0, LUAMEMHOOK_EXEC);
    #endif
    _PC++;
+#ifdef X6502_COMPUTED_GOTO
+   goto *optable[b1];
+#endif
    switch(b1)
    {
     #include "ops.inc"
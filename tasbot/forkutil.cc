@@ -0,0 +1,145 @@
+#include "forkutil.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+int NumLocalCores() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+// Write all of the bytes or die. Only used in the child.
+static void WriteAll(int fd, const void *buf, size_t len) {
+  const char *p = (const char *)buf;
+  while (len > 0) {
+    ssize_t w = write(fd, p, len);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      perror("forked worker write");
+      _exit(1);
+    }
+    p += w;
+    len -= w;
+  }
+}
+
+vector<string> ForkParallelComp(int num,
+                                const std::function<string(int)> &f,
+                                int max_concurrency) {
+  vector<string> results(num);
+  const int workers = min(num, max(max_concurrency, 1));
+  if (workers <= 1) {
+    for (int i = 0; i < num; i++) results[i] = f(i);
+    return results;
+  }
+
+  // Make sure buffered output isn't duplicated by the children.
+  fflush(stdout);
+  fflush(stderr);
+
+  // Worker w does jobs w, w + workers, w + 2 * workers, ...
+  // Each result is sent as the job index, the length, and the
+  // bytes. Jobs in a round are usually about the same size, so
+  // static striping is as good as a work queue and only costs one
+  // fork per worker.
+  vector<pid_t> pids;
+  vector<int> fds;
+  for (int w = 0; w < workers; w++) {
+    int fd[2];
+    CHECK(0 == pipe(fd));
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+      close(fd[0]);
+      // Don't hold siblings' pipes open, or we'd never see EOF.
+      for (int other : fds) close(other);
+      for (int i = w; i < num; i += workers) {
+        const string res = f(i);
+        const uint32 hdr[2] = { (uint32)i, (uint32)res.size() };
+        WriteAll(fd[1], hdr, sizeof (hdr));
+        WriteAll(fd[1], res.data(), res.size());
+      }
+      close(fd[1]);
+      // Skip atexit handlers and stdio flushing; those belong to
+      // the parent.
+      _exit(0);
+    }
+    close(fd[1]);
+    pids.push_back(pid);
+    fds.push_back(fd[0]);
+  }
+
+  // Read whichever pipes have data, so that a worker with a big
+  // result never waits on the ones before it. Each worker's bytes
+  // pile up in pending until a whole result is there.
+  vector<bool> done(num, false);
+  vector<string> pending(workers);
+  vector<struct pollfd> pfds(workers);
+  for (int w = 0; w < workers; w++) {
+    pfds[w].fd = fds[w];
+    pfds[w].events = POLLIN;
+  }
+  int live = workers;
+  char buf[65536];
+  while (live > 0) {
+    if (poll(&pfds[0], workers, -1) < 0) {
+      CHECK(errno == EINTR);
+      continue;
+    }
+    for (int w = 0; w < workers; w++) {
+      if (pfds[w].fd < 0 ||
+          !(pfds[w].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+      ssize_t r = read(pfds[w].fd, buf, sizeof (buf));
+      if (r < 0) {
+        if (errno == EINTR) continue;
+        perror("forked worker read");
+        abort();
+      }
+      if (r == 0) {
+        CHECK(pending[w].empty() && "Forked worker died mid-result.");
+        close(pfds[w].fd);
+        // poll ignores negative fds.
+        pfds[w].fd = -1;
+        live--;
+        continue;
+      }
+      string *p = &pending[w];
+      p->append(buf, r);
+      size_t used = 0;
+      uint32 hdr[2];
+      while (p->size() - used >= sizeof (hdr)) {
+        memcpy(hdr, p->data() + used, sizeof (hdr));
+        if (p->size() - used - sizeof (hdr) < hdr[1]) break;
+        CHECK(hdr[0] < (uint32)num && !done[hdr[0]]);
+        results[hdr[0]].assign(*p, used + sizeof (hdr), hdr[1]);
+        done[hdr[0]] = true;
+        used += sizeof (hdr) + hdr[1];
+      }
+      p->erase(0, used);
+    }
+  }
+
+  for (int w = 0; w < workers; w++) {
+    int status = 0;
+    while (waitpid(pids[w], &status, 0) < 0) {
+      CHECK(errno == EINTR);
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Forked worker %d failed (status %d).\n",
+              w, status);
+      abort();
+    }
+  }
+
+  for (int i = 0; i < num; i++) {
+    CHECK(done[i]);
+  }
+  return results;
+}
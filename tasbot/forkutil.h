@@ -0,0 +1,34 @@
+/* Parallelism across local cores without a reentrant emulator.
+
+   The FCEUX core keeps all of its state in globals, so we can't run
+   more than one emulator per process. But fork() gives each child a
+   copy-on-write snapshot of the whole process, including the loaded
+   game, the current emulator state and the step cache, so children
+   can do independent pieces of search work and send back just the
+   (small) answers. This is the in-process alternative to running
+   playfun --helper processes and talking to them over TCP. */
+
+#ifndef __TASBOT_FORKUTIL_H
+#define __TASBOT_FORKUTIL_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "tasbot.h"
+
+// Number of cores online, at least 1.
+int NumLocalCores();
+
+// Computes f(i) for every i in [0, num), using up to max_concurrency
+// forked child processes, and returns the results in index order.
+// f runs in a child, so any side effects it has on this process's
+// memory (including the emulator) are discarded. The exception is when
+// max_concurrency is 1 or there's only one job; then f just runs here
+// in this process, so callers should not depend on either behavior.
+// Aborts if any child fails.
+vector<string> ForkParallelComp(int num,
+                                const std::function<string(int)> &f,
+                                int max_concurrency);
+
+#endif
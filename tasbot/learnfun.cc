@@ -36,11 +36,8 @@
 static constexpr size_t FASTFORWARD = 0U;
 
 static void SaveMemory(vector< vector<uint8> > *memories) {
-  memories->resize(memories->size() + 1);
-  vector<uint8> *v = &memories->back();
-  for (int i = 0; i < 0x800; i++) {
-    v->push_back((uint8)RAM[i]);
-  }
+  const uint8 *ram = Emulator::GetMemoryPtr();
+  memories->emplace_back(ram, ram + 0x800);
 }
 
 static vector< vector<int> > *objectives = nullptr;
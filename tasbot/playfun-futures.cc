@@ -150,7 +150,7 @@ struct PlayFun {
     motifs = Motifs::LoadFromFile(GAME ".motifs");
     CHECK(motifs);
 
-    Emulator::ResetCache(100000, 10000);
+    Emulator::ResetCache(1024ULL << 20);
 
     motifvec = motifs->AllMotifs();
 
@@ -9,6 +9,9 @@
 #include <vector>
 #include <string>
 #include <set>
+#include <algorithm>
+#include <unordered_map>
+#include <chrono>
 #include <cmath>
 #include <cstring>
 
@@ -34,7 +37,10 @@
 #include "motifs.h"
 #include "../cc-lib/arcfour.h"
 #include "util.h"
+#include "forkutil.h"
+#include "checkpoints.h"
 #include "../cc-lib/textsvg.h"
+#include "../cc-lib/city/city.h"
 
 #if MARIONET
 #include "SDL.h"
@@ -144,6 +150,46 @@ struct Replacement {
   double score;
   string method;
 };
+
+// What ScoreByFuture computes for one future.
+struct FutureScores {
+  double positive, negative, integral;
+};
+
+// Scores of futures already run from some state. Nexts often lead to
+// the same state (they differ only in buttons the game ignores, or
+// in lag frames), and futures survive for many rounds, so the same
+// future gets run from the same state a lot. Objectives' weights
+// never change and Evaluate doesn't depend on what's been Observed,
+// so entries never go stale; the table is just emptied when it's
+// full. Keys hash the state's fingerprint and the future's inputs.
+struct TranspositionTable {
+  explicit TranspositionTable(size_t max_entries)
+    : max_entries(max_entries) {}
+
+  static uint128 Key(const uint128 &state, const vector<uint8> &inputs) {
+    return CityHash128WithSeed((const char *)inputs.data(), inputs.size(),
+			       state);
+  }
+
+  bool Find(const uint128 &key, FutureScores *scores) const {
+    auto it = table.find(Uint128Low64(key));
+    if (it == table.end() || it->second.first != Uint128High64(key))
+      return false;
+    *scores = it->second.second;
+    return true;
+  }
+
+  void Insert(const uint128 &key, const FutureScores &scores) {
+    if (table.size() >= max_entries) table.clear();
+    table[Uint128Low64(key)] = make_pair(Uint128High64(key), scores);
+  }
+
+ private:
+  const size_t max_entries;
+  // Low half of the key to the high half and the scores.
+  unordered_map<uint64, pair<uint64, FutureScores> > table;
+};
 }  // namespace
 
 static void SaveFuturesHTML(const vector<Future> &futures,
@@ -165,7 +211,11 @@ static void SaveFuturesHTML(const vector<Future> &futures,
 }
 
 struct PlayFun {
-  PlayFun() : watermark(0), log(NULL), rc("playfun") {
+  PlayFun() : checkpoints(HOT_CHECKPOINTS, WARM_CHECKPOINT_BYTES,
+			  StringPrintf("playfun-checkpoints-%d.spill",
+				       (int)getpid())),
+	      watermark(0), transpositions(TRANSPOSITION_ENTRIES),
+	      log(NULL), rc("playfun") {
     map<string, string> config = Util::ReadFileToMap("config.txt");
     if (config.empty()) {
       fprintf(stderr, "You need a file called config.txt; please "
@@ -178,6 +228,27 @@ struct PlayFun {
     CHECK(!game.empty());
     CHECK(!moviename.empty());
 
+    // Optional; defaults to one worker per core.
+    local_workers_ = config["workers"].empty() ? NumLocalCores() :
+      atoi(config["workers"].c_str());
+    CHECK(local_workers_ > 0);
+
+    // Optional; see ParallelStep.
+    halving_futures_ = atoi(config["halving"].c_str());
+    CHECK(halving_futures_ >= 0);
+
+    // Optional; see AdjustFutures.
+    nfutures_ = NFUTURES;
+    minfuturelength_ = MINFUTURELENGTH;
+    maxfuturelength_ = MAXFUTURELENGTH;
+    round_seconds_ = atof(config["roundseconds"].c_str());
+    CHECK(round_seconds_ >= 0.0);
+    step_seconds_ = 0.0;
+    step_frames_ = 0LL;
+    step_emulated_ = 0LL;
+    step_good_ = 0.5;
+    throughput_ = 0.0;
+
     Emulator::Initialize(game + ".nes");
     objectives = WeightedObjectives::LoadFromFile(game + ".objectives");
     CHECK(objectives);
@@ -186,11 +257,41 @@ struct PlayFun {
     motifs = Motifs::LoadFromFile(game + ".motifs");
     CHECK(motifs);
 
-    // XXX configure this via config.txt
-    // For 64-bit machines with loads of ram
-    // Emulator::ResetCache(100000, 10000);
-    // For modest systems
-    Emulator::ResetCache(100000, 10000);
+    // Optional; "search" makes states smaller by leaving out what the
+    // game can't see, if that plays the training movie the same way.
+    // Before the caches and archive, since it changes the states.
+    if (config["profile"] == "search") {
+      if (Emulator::VerifyProfile(Emulator::PROFILE_SEARCH,
+				    SimpleFM2::ReadInputs(moviename)) < 0) {
+	Emulator::SetProfile(Emulator::PROFILE_SEARCH);
+      } else {
+	fprintf(stderr, "The search profile changes how %s plays, so "
+		"using the full one.\n", moviename.c_str());
+      }
+    } else {
+      CHECK(config["profile"].empty() || config["profile"] == "full");
+    }
+
+    // Optional; megabytes for the step cache, which is per process.
+    const uint64 cache_mb = config["cachemb"].empty() ? 1024ULL :
+      strtoull(config["cachemb"].c_str(), NULL, 10);
+    Emulator::ResetCache(cache_mb << 20);
+
+    // Optional; an archive of states on disk, shared with the other
+    // playfun processes on this machine and kept between runs.
+    if (!config["archive"].empty()) {
+      const uint64 archive_mb = config["archivemb"].empty() ? 4096ULL :
+	strtoull(config["archivemb"].c_str(), NULL, 10);
+      Emulator::OpenArchive(config["archive"], archive_mb << 20);
+    }
+
+    // Optional; a step cache in shared memory, used by every playfun
+    // process on this machine along with its own.
+    if (!config["sharedcache"].empty()) {
+      const uint64 shared_mb = config["sharedcachemb"].empty() ? 1024ULL :
+	strtoull(config["sharedcachemb"].c_str(), NULL, 10);
+      Emulator::OpenSharedCache(config["sharedcache"], shared_mb << 20);
+    }
 
     motifvec = motifs->AllMotifs();
 
@@ -223,7 +324,7 @@ struct PlayFun {
   // Contains the movie we record (partial solution).
   vector<uint8> movie;
 
-  // Keeps savestates.
+  // A savestate from the movie.
   struct Checkpoint {
     vector<uint8> save;
     // such that truncating movie to length movenum
@@ -234,7 +335,8 @@ struct PlayFun {
     // For putting in containers.
     Checkpoint() : movenum(0) {}
   };
-  vector<Checkpoint> checkpoints;
+  // Keeps savestates, every CHECKPOINT_EVERY inputs.
+  CheckpointStore checkpoints;
 
   // Index below which we should not backtrack (because it
   // contains pre-game menu stuff, for example).
@@ -259,9 +361,37 @@ struct PlayFun {
   static const int MINFUTURELENGTH = 50;
   static const int MAXFUTURELENGTH = 800;
 
+  // The number of futures and their lengths. They start as above,
+  // but with a target time per round, AdjustFutures changes them.
+  int nfutures_, minfuturelength_, maxfuturelength_;
+  // Seconds per round to aim for, or 0 to keep them fixed.
+  double round_seconds_;
+  // Limits for AdjustFutures. There have to be more futures than
+  // get dropped each round, and they have to be long enough to make
+  // nexts from.
+  static const int MIN_NFUTURES = 16;
+  static const int MAX_NFUTURES = 160;
+  static const int MIN_FUTURELENGTH = 20;
+  static const int MAX_FUTURELENGTH = 6400;
+  // How the last ParallelStep went, for AdjustFutures: how long it
+  // took, its frames (every future from every next), how many of
+  // those were actually emulated (the rest were skipped by halving,
+  // transpositions or the trie), and the fraction of futures that
+  // scored above zero.
+  double step_seconds_;
+  int64 step_frames_, step_emulated_;
+  double step_good_;
+  // Emulated frames per second, averaged over rounds; 0 before the
+  // first.
+  double throughput_;
+
   static const bool TRY_BACKTRACK = true;
   // Make a checkpoint this often (number of inputs).
   static const int CHECKPOINT_EVERY = 100;
+  // Keep this many of the latest checkpoints uncompressed, and up to
+  // this much memory of older ones before spilling them to disk.
+  static const int HOT_CHECKPOINTS = 8;
+  static const uint64 WARM_CHECKPOINT_BYTES = 64ULL << 20;
   // In rounds, not inputs.
   static const int TRY_BACKTRACK_EVERY = 18;
   // In inputs.
@@ -271,6 +401,10 @@ struct PlayFun {
   // SVG) this often (number of inputs).
   static const int OBSERVE_EVERY = 10;
 
+  // Futures' scores to remember, per process. About 64 bytes each.
+  static const size_t TRANSPOSITION_ENTRIES = 1 << 20;
+  TranspositionTable transpositions;
+
   // Should always be the same length as movie.
   vector<string> subtitles;
 
@@ -281,7 +415,7 @@ struct PlayFun {
     if (movie.size() % CHECKPOINT_EVERY == 0) {
       vector<uint8> savestate;
       Emulator::SaveUncompressed(&savestate);
-      checkpoints.push_back(Checkpoint(savestate, movie.size()));
+      checkpoints.Push(movie.size(), savestate);
     }
 
     // PERF: This is very slow...
@@ -302,15 +436,22 @@ struct PlayFun {
     movie.resize(movenum);
     subtitles.resize(movenum);
     // Pop any checkpoints since movenum.
-    while (!checkpoints.empty() &&
-	   checkpoints.back().movenum > movenum) {
-      checkpoints.resize(checkpoints.size() - 1);
-    }
+    checkpoints.Truncate(movenum);
   }
 
   // DESTROYS THE STATE
   static void Dualize(vector<uint8> *v, int start, int len);
 
+  // Adds Evaluate over consecutive memories (one per step) to sum,
+  // starting from *previous_memory, which is left as the last one.
+  // changed has each step's changed bits, as from CachingSteps.
+  double SumEvaluations(double sum,
+			vector<uint8> *previous_memory,
+			vector< vector<uint8> > *memories,
+			const vector< vector<uint8> > &changed);
+
+  // Sum of Evaluate over each step of inputs from start_state, or
+  // from the emulator's base state (Emulator::MarkBase) if NULL.
   double ScoreIntegral(vector<uint8> *start_state,
                        const vector<uint8> &inputs,
                        vector<uint8> *final_memory);
@@ -330,6 +471,107 @@ struct PlayFun {
     *negative_scores = -objectives->WeightedLess(future_memory, base_memory);
   }
 
+  // For the round's diagnostics.
+  struct StepStats {
+    StepStats() : future_frames(0), emulated_frames(0),
+		  reused(0), evaluations(0) {}
+    // Frames in the futures that were run, and frames emulated
+    // running them as tries.
+    int64 future_frames, emulated_frames;
+    // Future evaluations (including the hold future) answered by a
+    // transposition table or a next with the same state, out of all.
+    int64 reused, evaluations;
+  };
+
+  // Same as ScoreByFuture from the emulator's base state, for every
+  // future at once. Futures share prefixes (mutants keep their
+  // parent's first half, and nexts are taken from futures), so they
+  // are run as a trie: in sorted order, depth-first, keeping a
+  // snapshot of the state, memory and running integral wherever the
+  // next one branches off. Every frame is then emulated and evaluated
+  // once no matter how many futures go through it. The sums are
+  // accumulated in the same order as ScoreIntegral, so the scores are
+  // exactly the same.
+  //
+  // Adds to stats' future_frames and emulated_frames.
+  void ScoreFutures(const vector<Future> &futures,
+		    const vector<uint8> &base_memory,
+		    vector<FutureScores> *scores,
+		    StepStats *stats) {
+    const size_t n = futures.size();
+    scores->resize(n);
+    vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(),
+		     [&futures](size_t a, size_t b) {
+		       return futures[a].inputs < futures[b].inputs;
+		     });
+
+    // common[k] is the length of the prefix order[k] has in common
+    // with order[k - 1].
+    vector<size_t> common(n + 1, 0);
+    for (size_t k = 1; k < n; k++) {
+      const vector<uint8> &a = futures[order[k - 1]].inputs;
+      const vector<uint8> &b = futures[order[k]].inputs;
+      size_t c = 0;
+      while (c < a.size() && c < b.size() && a[c] == b[c]) c++;
+      common[k] = c;
+    }
+
+    struct Snapshot {
+      size_t depth;
+      // Empty for the root, which is the base state.
+      vector<uint8> state;
+      vector<uint8> memory;
+      double sum;
+    };
+    vector<Snapshot> stack;
+    stack.push_back(Snapshot{0, {}, base_memory, 0.0});
+
+    vector<uint8> memory;
+    vector< vector<uint8> > memories, changed;
+    for (size_t k = 0; k < n; k++) {
+      const vector<uint8> &inputs = futures[order[k]].inputs;
+      stats->future_frames += inputs.size();
+      while (stack.back().depth > common[k]) stack.pop_back();
+      Snapshot &top = stack.back();
+      if (top.depth == 0) {
+	Emulator::RestoreBase();
+      } else {
+	Emulator::LoadUncompressed(&top.state);
+      }
+      memory = top.memory;
+      double sum = top.sum;
+      size_t depth = top.depth;
+
+      // Run up to where the next future branches off, save that,
+      // then run the rest.
+      const size_t branch = common[k + 1];
+      if (branch > depth) {
+	vector<uint8> prefix(inputs.begin() + depth, inputs.begin() + branch);
+	Emulator::CachingSteps(prefix, &memories, &changed);
+	sum = SumEvaluations(sum, &memory, &memories, changed);
+	stats->emulated_frames += branch - depth;
+	depth = branch;
+	Snapshot snap{depth, {}, memory, sum};
+	Emulator::SaveUncompressed(&snap.state);
+	stack.push_back(std::move(snap));
+      }
+      if (inputs.size() > depth) {
+	vector<uint8> rest(inputs.begin() + depth, inputs.end());
+	Emulator::CachingSteps(rest, &memories, &changed);
+	sum = SumEvaluations(sum, &memory, &memories, changed);
+	stats->emulated_frames += inputs.size() - depth;
+      }
+
+      FutureScores *s = &(*scores)[order[k]];
+      s->integral = sum / inputs.size();
+      s->positive = objectives->WeightedLess(base_memory, memory);
+      // Note negation; WeightedLess always returns non-negative score.
+      s->negative = -objectives->WeightedLess(memory, base_memory);
+    }
+  }
+
   #if MARIONET
   static void ReadBytesFromProto(const string &pf, vector<uint8> *bytes) {
     // PERF iterators.
@@ -376,35 +618,8 @@ struct PlayFun {
 	} else if (hreq.has_playfun()) {
 	  line += ", " ANSI_YELLOW "playfun" ANSI_RESET;
 	  term.Output(line + "\n");
-	  const PlayFunRequest &req = hreq.playfun();
-	  vector<uint8> next, current_state;
-	  ReadBytesFromProto(req.current_state(), &current_state);
-	  ReadBytesFromProto(req.next(), &next);
-	  vector<Future> futures;
-	  for (int i = 0; i < req.futures_size(); i++) {
-	    Future f;
-	    ReadBytesFromProto(req.futures(i).inputs(), &f.inputs);
-	    futures.push_back(f);
-	  }
-
-	  double immediate_score, best_future_score, worst_future_score,
-	    futures_score;
-	  vector<double> futurescores(futures.size(), 0.0);
-
-	  // Do the work.
-	  InnerLoop(next, futures, &current_state,
-		    &immediate_score, &best_future_score,
-		    &worst_future_score, &futures_score,
-		    &futurescores);
-
 	  PlayFunResponse res;
-	  res.set_immediate_score(immediate_score);
-	  res.set_best_future_score(best_future_score);
-	  res.set_worst_future_score(worst_future_score);
-	  res.set_futures_score(futures_score);
-	  for (int i = 0; i < futurescores.size(); i++) {
-	    res.add_futurescores(futurescores[i]);
-	  }
+	  DoPlayFun(hreq.playfun(), &res);
 
 	  // fprintf(stderr, "Result: %s\n", res.DebugString().c_str());
 	  cache.Save(hreq, res);
@@ -443,6 +658,73 @@ struct PlayFun {
     }
   }
 
+  void DoPlayFun(const PlayFunRequest &req, PlayFunResponse *res) {
+    vector<uint8> next, current_state;
+    ReadBytesFromProto(req.current_state(), &current_state);
+    ReadBytesFromProto(req.next(), &next);
+    vector<Future> futures;
+    for (int i = 0; i < req.futures_size(); i++) {
+      Future f;
+      ReadBytesFromProto(req.futures(i).inputs(), &f.inputs);
+      futures.push_back(f);
+    }
+
+    double immediate_score, best_future_score, worst_future_score,
+      futures_score;
+    vector<double> futurescores(futures.size(), 0.0);
+    vector<FutureScores> scores;
+    StepStats stats;
+
+    // Older masters don't say.
+    const size_t hold_length = req.has_hold_length() ?
+      req.hold_length() : AverageLength(futures);
+
+    // Do the work.
+    InnerLoop(next, futures, hold_length, &current_state,
+	      &immediate_score, &best_future_score,
+	      &worst_future_score, &futures_score,
+	      &futurescores, &scores, &stats);
+
+    res->set_immediate_score(immediate_score);
+    res->set_best_future_score(best_future_score);
+    res->set_worst_future_score(worst_future_score);
+    res->set_futures_score(futures_score);
+    for (int i = 0; i < futurescores.size(); i++) {
+      res->add_futurescores(futurescores[i]);
+    }
+    for (const FutureScores &fs : scores) {
+      res->add_positives(fs.positive);
+      res->add_negatives(fs.negative);
+      res->add_integrals(fs.integral);
+    }
+    res->set_reused(stats.reused);
+    res->set_future_frames(stats.future_frames);
+    res->set_emulated_frames(stats.emulated_frames);
+  }
+
+  // Gets the responses to the requests, in order, like GetAnswers
+  // but without any helpers. Instead the work is done in forked
+  // copies of this process (see forkutil.h), up to local_workers_
+  // of them at once. f computes one response from one request.
+  template<class Response, class F>
+  void LocalAnswers(const vector<HelperRequest> &requests,
+		    const F &f,
+		    vector<Response> *responses) {
+    vector<string> out =
+      ForkParallelComp(static_cast<int>(requests.size()),
+		       [&requests, &f](int i) -> string {
+			 Response res;
+			 f(requests[i], &res);
+			 return res.SerializeAsString();
+		       },
+		       local_workers_);
+    responses->clear();
+    responses->resize(out.size());
+    for (size_t i = 0; i < out.size(); ++i) {
+      CHECK((*responses)[i].ParseFromString(out[i]));
+    }
+  }
+
   template<class F, class S>
   struct CompareByFirstDesc {
     bool operator ()(const pair<F, S> &a,
@@ -750,9 +1032,7 @@ struct PlayFun {
 			     const vector<uint8> &end_memory,
 			     double *score) {
     Emulator::LoadUncompressed(start_state);
-    for (int i = 0; i < inputs.size(); i++) {
-      Emulator::CachingStep(inputs[i]);
-    }
+    Emulator::CachingSteps(inputs, NULL, NULL);
 
     vector<uint8> new_memory;
     Emulator::GetMemory(&new_memory);
@@ -811,14 +1091,37 @@ struct PlayFun {
   }
   #endif
 
+  static size_t AverageLength(const vector<Future> &futures) {
+    size_t total_future_length = 0;
+    for (const auto &future : futures) {
+      total_future_length += future.inputs.size();
+    }
+    return total_future_length / futures.size();
+  }
+
+  // Synthetic future where we keep holding the last button
+  // pressed, usually as long as the average future.
+  static Future HoldFuture(size_t length, uint8 last) {
+    Future fakefuture_hold;
+    for (size_t z = 0; z < length; ++z) {
+      fakefuture_hold.inputs.push_back(last);
+    }
+    return fakefuture_hold;
+  }
+
+  // Scores next by the futures, plus a hold future of hold_length
+  // (if it's not zero).
   void InnerLoop(const vector<uint8> &next,
 		 const vector<Future> &futures_orig,
+		 size_t hold_length,
 		 vector<uint8> *current_state,
 		 double *immediate_score,
 		 double *best_future_score,
 		 double *worst_future_score,
 		 double *futures_score,
-		 vector<double> *futurescores) {
+		 vector<double> *futurescores,
+		 vector<FutureScores> *scores,
+		 StepStats *stats) {
 
     // Make copy so we can make fake futures.
     vector<Future> futures = futures_orig;
@@ -828,15 +1131,15 @@ struct PlayFun {
     vector<uint8> current_memory;
     Emulator::GetMemory(&current_memory);
 
-    // Take steps.
-    for (uint8 input : next)
-      Emulator::CachingStep(input);
+    // Take steps. Nexts from the same state often share a prefix.
+    Emulator::CachingSteps(next, NULL, NULL);
 
     vector<uint8> new_memory;
     Emulator::GetMemory(&new_memory);
 
-    vector<uint8> new_state;
-    Emulator::SaveUncompressed(&new_state);
+    // Every future starts here, so only what each one changes needs
+    // to be restored.
+    Emulator::MarkBase();
 
     // Used to be BuggyEvaluate = WeightedLess? XXX
     *immediate_score = objectives->Evaluate(current_memory, new_memory);
@@ -851,31 +1154,38 @@ struct PlayFun {
 
 
     // XXX reconsider whether this is really useful
-    {
-      // Synthetic future where we keep holding the last
-      // button pressed.
-      // static const int NUM_FAKE_FUTURES = 1;
-      size_t total_future_length = 0;
-      for (const auto &future : futures) {
-        total_future_length += future.inputs.size();
-      }
-
-      const size_t average_future_length = total_future_length / futures.size();
-      
-      Future fakefuture_hold;
-      for (size_t z = 0; z < average_future_length; ++z) {
-	fakefuture_hold.inputs.push_back(next.back());
+    if (hold_length > 0)
+      futures.push_back(HoldFuture(hold_length, next.back()));
+
+    // Only run the futures that haven't been run from this state.
+    const uint128 after = Emulator::StateFingerprint();
+    scores->resize(futures.size());
+    vector<Future> torun;
+    vector<size_t> torun_idx;
+    for (size_t f = 0; f < futures.size(); ++f) {
+      if (!transpositions.Find(TranspositionTable::Key(after,
+						       futures[f].inputs),
+			       &(*scores)[f])) {
+	torun.push_back(futures[f]);
+	torun_idx.push_back(f);
       }
-      futures.push_back(fakefuture_hold);
+    }
+    stats->reused += futures.size() - torun.size();
+    stats->evaluations += futures.size();
+
+    vector<FutureScores> ran;
+    ScoreFutures(torun, new_memory, &ran, stats);
+    for (size_t j = 0; j < torun.size(); ++j) {
+      (*scores)[torun_idx[j]] = ran[j];
+      transpositions.Insert(TranspositionTable::Key(after, torun[j].inputs),
+			    ran[j]);
     }
 
     *futures_score = 0.0;
     for (size_t f = 0; f < futures.size(); ++f) {
-      if (f != 0) Emulator::LoadUncompressed(&new_state);
-      double positive_scores, negative_scores, integral_score;
-      ScoreByFuture(futures[f], new_memory, &new_state,
-		    &positive_scores, &negative_scores,
-		    &integral_score);
+      const double positive_scores = (*scores)[f].positive;
+      const double negative_scores = (*scores)[f].negative;
+      const double integral_score = (*scores)[f].integral;
       CHECK(positive_scores >= 0);
       CHECK(negative_scores <= 0);
 
@@ -919,29 +1229,67 @@ struct PlayFun {
     // futures.resize(futures.size() - NUM_FAKE_FUTURES);
   }
 
-  // The parallel step. We either run it in serial locally
-  // (without MARIONET) or as jobs on helpers, via TCP.
-  void ParallelStep(const vector< vector<uint8> > &nexts,
-                    const vector<Future> &futures,
-                    // morally const
-                    vector<uint8> *current_state,
-                    [[maybe_unused]] const vector<uint8> &current_memory,
-                    vector<double> *futuretotals,
-                    int *best_next_idx) {
-    uint64 start_time = time(NULL);
-    fprintf(stderr, "Parallel step with %zu nexts, %zu futures.\n",
-            nexts.size(), futures.size());
-    CHECK(nexts.size() > 0);
-    *best_next_idx = 0;
+  // One next's results from InnerLoop.
+  struct NextScores {
+    double immediate_score, best_future_score, worst_future_score,
+      futures_score;
+    // Parallel to the futures (not including the hold future).
+    vector<double> futurescores;
+  };
 
-    double best_score = 0.0;
-    Scoredist distribution(movie.size());
+  // Runs InnerLoop for each of the nexts. We either run it in serial
+  // locally (without MARIONET) or as jobs on helpers, via TCP. With
+  // MARIONET but no helpers, the jobs run in forked local workers.
+  void ScoreNexts(const vector< vector<uint8> > &nexts,
+		  const vector<Future> &futures,
+		  size_t hold_length,
+		  // morally const
+		  vector<uint8> *current_state,
+		  vector<NextScores> *out,
+		  StepStats *stats) {
+    out->clear();
+    out->resize(nexts.size());
+    const int64 evaluations = futures.size() + (hold_length > 0 ? 1 : 0);
 
 #if MARIONET
+    // Where each next leads. Nexts that get to the same state (with
+    // the same last input, which makes the hold future) get the same
+    // answer, so only the first is asked for. If every future has
+    // been run from there before, it's answered here.
+    vector<uint128> after(nexts.size());
+    vector<int> same_as(nexts.size(), -1);
+    vector<bool> known(nexts.size(), false);
+    {
+      map<pair<uint128, uint8>, int> first;
+      for (size_t i = 0; i < nexts.size(); ++i) {
+	Emulator::LoadUncompressed(current_state);
+	Emulator::CachingSteps(nexts[i], NULL, NULL);
+	after[i] = Emulator::StateFingerprint();
+	auto p = first.insert(make_pair(make_pair(after[i], nexts[i].back()),
+					static_cast<int>(i)));
+	if (!p.second) {
+	  same_as[i] = p.first->second;
+	  continue;
+	}
+	FutureScores unused;
+	known[i] = hold_length == 0 ||
+	  transpositions.Find(TranspositionTable::Key(
+	      after[i], HoldFuture(hold_length, nexts[i].back()).inputs),
+			      &unused);
+	for (size_t f = 0; known[i] && f < futures.size(); ++f) {
+	  known[i] = transpositions.Find(
+	      TranspositionTable::Key(after[i], futures[f].inputs), &unused);
+	}
+      }
+    }
+
     // One piece of work per request.
     vector<HelperRequest> requests;
     requests.resize(nexts.size());
+    vector<size_t> asked;
+    vector<PlayFunResponse> responses(nexts.size());
     for (size_t i = 0; i < nexts.size(); ++i) {
+      if (same_as[i] >= 0) continue;
       PlayFunRequest *req = requests[i].mutable_playfun();
       req->set_current_state(&((*current_state)[0]), current_state->size());
       req->set_next(&nexts[i][0], nexts[i].size());
@@ -950,76 +1298,280 @@ struct PlayFun {
 	fp->set_inputs(&futures[f].inputs[0],
 		       futures[f].inputs.size());
       }
+      req->set_hold_length(hold_length);
       // if (!i) fprintf(stderr, "REQ: %s\n", req->DebugString().c_str());
+      if (known[i]) {
+	DoPlayFun(*req, &responses[i]);
+      } else {
+	asked.push_back(i);
+      }
     }
-
-    GetAnswers<HelperRequest, PlayFunResponse> getanswers(ports_, requests);
-    getanswers.Loop();
-
-    const vector<GetAnswers<HelperRequest, PlayFunResponse>::Work> &work =
-      getanswers.GetWork();
-
-    for (size_t i = 0; i < work.size(); ++i) {
-      const PlayFunResponse &res = work[i].res;
-      const size_t res_futurescores_size =
-    	static_cast<size_t>(res.futurescores_size());
-      for (size_t f = 0; f < res_futurescores_size; ++f) {
-    	CHECK(f < futuretotals->size());
-    	(*futuretotals)[f] += res.futurescores(static_cast<int>(f));
+    vector<HelperRequest> asked_requests;
+    for (size_t i : asked) asked_requests.push_back(requests[i]);
+
+    vector<PlayFunResponse> answers;
+    if (ports_.empty()) {
+      // No helpers, so use the local cores.
+      LocalAnswers(asked_requests,
+		   [this](const HelperRequest &hreq, PlayFunResponse *res) {
+		     DoPlayFun(hreq.playfun(), res);
+		   },
+		   &answers);
+    } else if (!asked_requests.empty()) {
+      GetAnswers<HelperRequest, PlayFunResponse>
+	getanswers(ports_, asked_requests);
+      getanswers.Loop();
+
+      const vector<GetAnswers<HelperRequest, PlayFunResponse>::Work> &work =
+	getanswers.GetWork();
+      for (size_t i = 0; i < work.size(); ++i) {
+	answers.push_back(work[i].res);
       }
+    }
 
-      const double score = res.immediate_score() + res.futures_score();
-
-      distribution.immediates.push_back(res.immediate_score());
-      distribution.positives.push_back(res.futures_score());
-      distribution.negatives.push_back(res.worst_future_score());
-      // XXX norm score is disabled because it can't be
-      // computed in a distributed fashion.
-      distribution.norms.push_back(0);
+    // Remember what the helpers (or forked workers, which only had a
+    // copy of the table) ran, for later rounds.
+    for (size_t j = 0; j < asked.size(); ++j) {
+      const size_t i = asked[j];
+      responses[i] = answers[j];
+      const PlayFunResponse &res = responses[i];
+      // Older helpers don't send the scores of each future.
+      if (res.positives_size() != evaluations ||
+	  res.negatives_size() != evaluations ||
+	  res.integrals_size() != evaluations)
+	continue;
+      const Future hold = HoldFuture(hold_length, nexts[i].back());
+      for (int f = 0; f < evaluations; ++f) {
+	const vector<uint8> &inputs =
+	  f < futures.size() ? futures[f].inputs : hold.inputs;
+	FutureScores fs;
+	fs.positive = res.positives(f);
+	fs.negative = res.negatives(f);
+	fs.integral = res.integrals(f);
+	transpositions.Insert(TranspositionTable::Key(after[i], inputs), fs);
+      }
+    }
 
-      if (score > best_score) {
-	best_score = score;
-    	*best_next_idx = static_cast<int>(i);
+    for (size_t i = 0; i < nexts.size(); ++i) {
+      if (same_as[i] >= 0) {
+	responses[i] = responses[same_as[i]];
+	stats->reused += evaluations;
+      } else {
+	stats->reused += responses[i].reused();
+	stats->future_frames += responses[i].future_frames();
+	stats->emulated_frames += responses[i].emulated_frames();
+      }
+      stats->evaluations += evaluations;
+
+      const PlayFunResponse &res = responses[i];
+      NextScores *ns = &(*out)[i];
+      ns->immediate_score = res.immediate_score();
+      ns->best_future_score = res.best_future_score();
+      ns->worst_future_score = res.worst_future_score();
+      ns->futures_score = res.futures_score();
+      CHECK(static_cast<size_t>(res.futurescores_size()) == futures.size());
+      for (int f = 0; f < res.futurescores_size(); ++f) {
+	ns->futurescores.push_back(res.futurescores(f));
       }
     }
 
 #else
     // Local version.
     for (size_t i = 0; i < nexts.size(); ++i) {
-      double immediate_score, best_future_score, worst_future_score,
-	futures_score;
-      vector<double> futurescores(NFUTURES, 0.0);
+      NextScores *ns = &(*out)[i];
+      ns->futurescores.resize(futures.size(), 0.0);
+      vector<FutureScores> scores;
       InnerLoop(nexts[i],
 		futures,
+		hold_length,
 		current_state,
-		&immediate_score,
-		&best_future_score,
-		&worst_future_score,
-		&futures_score,
-		&futurescores);
-
-      for (size_t f = 0; f < futurescores.size(); ++f) {
-	(*futuretotals)[f] += futurescores[f];
-      }
+		&ns->immediate_score,
+		&ns->best_future_score,
+		&ns->worst_future_score,
+		&ns->futures_score,
+		&ns->futurescores,
+		&scores,
+		stats);
+    }
+#endif
+  }
 
-      double score = immediate_score + futures_score;
+  // The parallel step: scores every next by the futures and picks
+  // the best. With successive halving (halving_futures_ > 0), every
+  // next is first scored by that many of the futures (and the hold
+  // future), then the worse half is dropped and the rest get twice
+  // as many more, until one is left or they've had them all.
+  // Fills in stats for the round.
+  void ParallelStep(const vector< vector<uint8> > &nexts,
+                    const vector<Future> &futures,
+                    // morally const
+                    vector<uint8> *current_state,
+                    [[maybe_unused]] const vector<uint8> &current_memory,
+                    vector<double> *futuretotals,
+                    int *best_next_idx,
+                    StepStats *out_stats) {
+    uint64 start_time = time(NULL);
+    fprintf(stderr, "Parallel step with %zu nexts, %zu futures.\n",
+            nexts.size(), futures.size());
+    CHECK(nexts.size() > 0);
+    *best_next_idx = 0;
+
+    double best_score = 0.0;
+    Scoredist distribution(movie.size());
+    StepStats &stats = *out_stats;
+    stats = StepStats();
+    const size_t hold_length = AverageLength(futures);
+
+    if (halving_futures_ <= 0 ||
+	static_cast<size_t>(halving_futures_) >= futures.size()) {
+      vector<NextScores> scores;
+      ScoreNexts(nexts, futures, hold_length, current_state,
+		 &scores, &stats);
+
+      for (size_t i = 0; i < scores.size(); ++i) {
+	const NextScores &ns = scores[i];
+	for (size_t f = 0; f < ns.futurescores.size(); ++f) {
+	  CHECK(f < futuretotals->size());
+	  (*futuretotals)[f] += ns.futurescores[f];
+	}
+
+	const double score = ns.immediate_score + ns.futures_score;
+
+	distribution.immediates.push_back(ns.immediate_score);
+	distribution.positives.push_back(ns.futures_score);
+	distribution.negatives.push_back(ns.worst_future_score);
+	// XXX norm score is disabled because it can't be
+	// computed in a distributed fashion.
+	distribution.norms.push_back(0);
+
+	if (score > best_score) {
+	  best_score = score;
+	  *best_next_idx = static_cast<int>(i);
+	}
+      }
+    } else {
+      // Futures are handed out in a random order, so the first
+      // stages aren't always the same few.
+      vector<size_t> order;
+      for (size_t f = 0; f < futures.size(); ++f) order.push_back(f);
+      Shuffle(&order);
+
+      // Totals over the stages for each next, and how many futures
+      // (including the hold future) went into them.
+      vector<NextScores> totals(nexts.size());
+      vector<int> evaluated(nexts.size(), 0);
+      for (NextScores &t : totals) {
+	t.futures_score = 0.0;
+	t.best_future_score = -1e80;
+	t.worst_future_score = 1e80;
+      }
+      // Each future's scores, summed over the nexts that ran it.
+      vector<double> futuresums(futures.size(), 0.0);
+      vector<int> futurecounts(futures.size(), 0);
+
+      vector<size_t> alive;
+      for (size_t i = 0; i < nexts.size(); ++i) alive.push_back(i);
+      auto Score = [&totals](size_t i) {
+	return totals[i].immediate_score + totals[i].futures_score;
+      };
+
+      string schedule;
+      size_t done = 0, stage = halving_futures_;
+      for (;;) {
+	const size_t upto = min(done + stage, futures.size());
+	vector<Future> some;
+	for (size_t f = done; f < upto; ++f) some.push_back(futures[order[f]]);
+	vector< vector<uint8> > somenexts;
+	for (size_t i : alive) somenexts.push_back(nexts[i]);
+	// The hold future only counts once.
+	const size_t hold = done == 0 ? hold_length : 0;
+	vector<NextScores> scores;
+	ScoreNexts(somenexts, some, hold, current_state, &scores, &stats);
+	schedule += StringPrintf("%s%zux%zu", done == 0 ? "" : ", ",
+				 alive.size(), upto - done);
+
+	for (size_t j = 0; j < alive.size(); ++j) {
+	  const NextScores &ns = scores[j];
+	  NextScores *t = &totals[alive[j]];
+	  t->immediate_score = ns.immediate_score;
+	  t->futures_score += ns.futures_score;
+	  t->best_future_score = max(t->best_future_score,
+				     ns.best_future_score);
+	  t->worst_future_score = min(t->worst_future_score,
+				      ns.worst_future_score);
+	  evaluated[alive[j]] += some.size() + (hold > 0 ? 1 : 0);
+	  for (size_t f = 0; f < some.size(); ++f) {
+	    futuresums[order[done + f]] += ns.futurescores[f];
+	    futurecounts[order[done + f]]++;
+	  }
+	}
+	done = upto;
+	if (done == futures.size()) break;
+
+	// Keep the better half (rounding up).
+	std::stable_sort(alive.begin(), alive.end(),
+			 [&Score](size_t a, size_t b) {
+			   return Score(a) > Score(b);
+			 });
+	alive.resize((alive.size() + 1) / 2);
+	std::sort(alive.begin(), alive.end());
+	if (alive.size() == 1) break;
+	stage *= 2;
+      }
+      fprintf(stderr, "Halving: %s (nexts x futures).\n", schedule.c_str());
+
+      // Every next that's still alive has had the same futures, and
+      // the pick is one of them even if none scores above zero.
+      *best_next_idx = static_cast<int>(alive[0]);
+      best_score = Score(alive[0]);
+      for (size_t i : alive) {
+	if (Score(i) > best_score) {
+	  best_score = Score(i);
+	  *best_next_idx = static_cast<int>(i);
+	}
+      }
 
-      distribution.immediates.push_back(immediate_score);
-      distribution.positives.push_back(futures_score);
-      distribution.negatives.push_back(worst_future_score);
-      // XXX norm score is disabled because it can't be
-      // computed in a distributed fashion.
-      distribution.norms.push_back(0);
+      // The futures' totals are extrapolated to all of the nexts from
+      // the ones that ran them. Ones that nobody got to get the
+      // average, so that they're neither dropped nor kept for it.
+      double sum = 0.0;
+      int counted = 0;
+      for (size_t f = 0; f < futures.size(); ++f) {
+	if (futurecounts[f] > 0) {
+	  sum += futuresums[f] * nexts.size() / futurecounts[f];
+	  counted++;
+	}
+      }
+      for (size_t f = 0; f < futures.size(); ++f) {
+	CHECK(f < futuretotals->size());
+	(*futuretotals)[f] += futurecounts[f] > 0 ?
+	  futuresums[f] * nexts.size() / futurecounts[f] : sum / counted;
+      }
 
-      if (score > best_score) {
-	best_score = score;
-    	*best_next_idx = static_cast<int>(i);
+      // Likewise, the futures part of each next's score is scaled
+      // up as if it had had all of them.
+      for (size_t i = 0; i < nexts.size(); ++i) {
+	distribution.immediates.push_back(totals[i].immediate_score);
+	distribution.positives.push_back(totals[i].futures_score *
+					 (futures.size() + 1) /
+					 evaluated[i]);
+	distribution.negatives.push_back(totals[i].worst_future_score);
+	distribution.norms.push_back(0);
       }
     }
-#endif
+
     distribution.chosen_idx = *best_next_idx;
     distributions.push_back(distribution);
 
+    fprintf(stderr, "Futures: %lld frames, %lld emulated as a trie "
+	    "(%.1f%%).\n",
+	    (long long)stats.future_frames, (long long)stats.emulated_frames,
+	    stats.future_frames > 0 ?
+	    (100.0 * stats.emulated_frames) / stats.future_frames : 0.0);
+    fprintf(stderr, "Transpositions: %lld of %lld future evaluations "
+	    "avoided.\n", (long long)stats.reused,
+	    (long long)stats.evaluations);
+
     uint64 end_time = time(NULL);
     fprintf(stderr, "Parallel step took %d seconds.\n",
 	    (int)(end_time - start_time));
@@ -1033,18 +1585,20 @@ struct PlayFun {
       }
     }
 
-    int num_to_weight = max(NWEIGHTEDFUTURES - num_currently_weighted, 0);
+    // Same proportion as the defaults.
+    const int nweighted = nfutures_ * NWEIGHTEDFUTURES / NFUTURES;
+    int num_to_weight = max(nweighted - num_currently_weighted, 0);
     #ifdef DEBUGFUTURES
         fprintf(stderr, "there are %zu futures, %d cur weighted, %d need\n",
           futures->size(), num_currently_weighted, num_to_weight);
     #endif
-        while (futures->size() < static_cast<size_t>(NFUTURES)) {
+        while (futures->size() < static_cast<size_t>(nfutures_)) {
       // Keep the desired length around so that we only
       // resize the future if we drop it. Randomize between
       // MIN and MAX future lengths.
-      int flength = MINFUTURELENGTH +
+      int flength = minfuturelength_ +
 	(int)
-	((double)(MAXFUTURELENGTH - MINFUTURELENGTH) *
+	((double)(maxfuturelength_ - minfuturelength_) *
 	 RandomDouble(&rc));
 
       if (num_to_weight > 0) {
@@ -1055,9 +1609,19 @@ struct PlayFun {
       }
     }
 
+    // Futures made before AdjustFutures last changed the lengths
+    // (and their mutants) are brought into the new range.
+    for (Future &future : *futures) {
+      future.desired_length = max(minfuturelength_,
+				  min(maxfuturelength_,
+				      future.desired_length));
+      if (future.inputs.size() > static_cast<size_t>(future.desired_length))
+	future.inputs.resize(future.desired_length);
+    }
+
     // Make sure we have enough futures with enough data in.
     // PERF: Should avoid creating exact duplicate futures.
-    for (size_t i = 0; i < static_cast<size_t>(NFUTURES); ++i) {
+    for (size_t i = 0; i < futures->size(); ++i) {
       while ((*futures)[i].inputs.size() <
 	     static_cast<size_t>((*futures)[i].desired_length)) {
 	const vector<uint8> &m =
@@ -1094,7 +1658,7 @@ struct PlayFun {
     out.desired_length = input.desired_length;
 
     // Replace tail with something random.
-    out.inputs.resize(max(MINFUTURELENGTH, input.desired_length / 2));
+    out.inputs.resize(max(minfuturelength_, input.desired_length / 2));
 
     // Occasionally, try something very different.
     if ((rc.Byte() & 7) == 0) {
@@ -1116,9 +1680,9 @@ struct PlayFun {
     vector<uint8> current_state;
     vector<uint8> current_memory;
 
-    if (futures->size() != static_cast<size_t>(NFUTURES)) {
+    if (futures->size() != static_cast<size_t>(nfutures_)) {
       fprintf(stderr, "?? Expected futures to have size %d but "
-	      "it has %zu.\n", NFUTURES, futures->size());
+	      "it has %zu.\n", nfutures_, futures->size());
     }
 
     // Save our current state so we can try many different branches.
@@ -1130,13 +1694,29 @@ struct PlayFun {
 
     // Most of the computation happens here.
     int best_next_idx = -1;
+    StepStats stats;
+    const auto step_start = std::chrono::steady_clock::now();
     ParallelStep(nexts, *futures,
 		 &current_state, current_memory,
 		 &futuretotals,
-		 &best_next_idx);
+		 &best_next_idx,
+		 &stats);
     CHECK(best_next_idx >= 0);
     CHECK(static_cast<size_t>(best_next_idx) < nexts.size());
 
+    step_seconds_ = std::chrono::duration<double>(
+	std::chrono::steady_clock::now() - step_start).count();
+    step_emulated_ = stats.emulated_frames;
+    step_frames_ = 0LL;
+    int good = 0;
+    for (size_t i = 0; i < futures->size(); ++i) {
+      step_frames_ += (*futures)[i].inputs.size() * nexts.size();
+      if (futuretotals[i] > 0.0) good++;
+    }
+    step_good_ = futures->empty() ? 0.5 : (double)good / futures->size();
+    // Only for regular rounds, before futures are dropped and made.
+    if (chopfutures && round_seconds_ > 0.0) AdjustFutures();
+
     if (chopfutures) {
       // fprintf(stderr, "Chop futures.\n");
       // Chop the head off each future.
@@ -1161,7 +1741,11 @@ struct PlayFun {
     // They'll be replaced the next time around the loop.
     // PERF don't really need to make DROPFUTURES passes,
     // but there are not many futures and not many dropfutures.
-    static const int TOTAL_TO_DROP = DROPFUTURES + MUTATEFUTURES;
+    // Also drop extras if AdjustFutures wants fewer.
+    const int TOTAL_TO_DROP =
+      min(max(DROPFUTURES + MUTATEFUTURES,
+	      static_cast<int>(futures->size()) + MUTATEFUTURES - nfutures_),
+	  static_cast<int>(futures->size()) - 1);
     for (int t = 0; t < TOTAL_TO_DROP; t++) {
       // fprintf(stderr, "Drop futures (%d/%d).\n", t, DROPFUTURES);
       CHECK(!futures->empty());
@@ -1319,10 +1903,10 @@ struct PlayFun {
         static_cast<long long>(iters), movie.size(), rounds_until_backtrack);
 
       const size_t max_to_print =
-  checkpoints.size() < 3 ? checkpoints.size() : 3;
+  checkpoints.Size() < 3 ? checkpoints.Size() : 3;
       for (size_t i = 0; i < max_to_print; ++i) {
-  const size_t idx = checkpoints.size() - 1 - i;
-  fprintf(stderr, "%d, ", checkpoints[idx].movenum);
+  const size_t idx = checkpoints.Size() - 1 - i;
+  fprintf(stderr, "%d, ", checkpoints.MoveNum(idx));
       }
       fprintf(stderr, "...\n");
 
@@ -1338,6 +1922,67 @@ struct PlayFun {
     }
   }
 
+  // Sets the number and lengths of futures that PopulateFutures
+  // makes, so that a round takes about round_seconds_. The frames
+  // actually emulated last round, at the speed so far, say how long
+  // a round of the current futures takes; the budget of frames
+  // (futures times their average length) is scaled by how far that
+  // is from the target. When futures are bad in general, it's spent
+  // on more, shorter ones; when they're good, fewer and longer. Logs
+  // what it decides.
+  void AdjustFutures() {
+    // A round answered entirely from the transposition table says
+    // nothing about speed.
+    if (step_seconds_ <= 0.0 || step_emulated_ <= 0) return;
+    const double throughput = step_emulated_ / step_seconds_;
+    throughput_ = throughput_ == 0.0 ? throughput :
+      0.7 * throughput_ + 0.3 * throughput;
+
+    // Scaled to fit in the target, but not by less than half or
+    // more than double in one round.
+    const double cur_budget =
+      nfutures_ * (minfuturelength_ + maxfuturelength_) / 2.0;
+    const double scale = round_seconds_ * throughput_ / step_emulated_;
+    const double budget = cur_budget * max(0.5, min(2.0, scale));
+
+    // The shape is length per future; the defaults' when half of
+    // the futures are good, up to twice that when all are and half
+    // when none are.
+    const double default_length = (MINFUTURELENGTH + MAXFUTURELENGTH) / 2.0;
+    const double shape =
+      default_length / NFUTURES * pow(2.0, 2.0 * step_good_ - 1.0);
+    const int n = max(MIN_NFUTURES,
+		      min(MAX_NFUTURES, (int)round(sqrt(budget / shape))));
+    const double length = budget / n;
+    // The same spread as the defaults.
+    const int lo = max(MIN_FUTURELENGTH,
+		       (int)(length * MINFUTURELENGTH / default_length));
+    const int hi = max(lo + 1, min(MAX_FUTURELENGTH,
+				   (int)(length * MAXFUTURELENGTH /
+					 default_length)));
+
+    fprintf(stderr, "Adjust futures: round took %.1fs (target %.1fs), "
+	    "%.0f emulated frames/sec, %.0f%% of frames emulated, "
+	    "%.0f%% good. Now %d of %d-%d inputs.\n",
+	    step_seconds_, round_seconds_, throughput_,
+	    step_frames_ > 0 ? (100.0 * step_emulated_) / step_frames_ : 0.0,
+	    step_good_ * 100.0, n, lo, hi);
+    fprintf(log,
+	    "<li>Round at frame %zu took %.1fs (target %.1fs) at %.0f "
+	    "emulated frames/sec (%.0f%% of frames emulated), %.0f%% of "
+	    "futures good: %d futures of "
+	    "%d&ndash;%d inputs (was %d of %d&ndash;%d).</li>\n",
+	    movie.size(), step_seconds_, round_seconds_, throughput_,
+	    step_frames_ > 0 ? (100.0 * step_emulated_) / step_frames_ : 0.0,
+	    step_good_ * 100.0, n, lo, hi,
+	    nfutures_, minfuturelength_, maxfuturelength_);
+    fflush(log);
+
+    nfutures_ = n;
+    minfuturelength_ = lo;
+    maxfuturelength_ = hi;
+  }
+
   // Make the nexts that we should try for this round.
   void MakeNexts(const vector<Future> &futures,
 		 vector< vector<uint8> > *nexts,
@@ -1476,19 +2121,31 @@ struct PlayFun {
       requests.push_back(hreq);
     }
 
-    GetAnswers<HelperRequest, TryImproveResponse>
-      getanswers(ports_, requests);
-    getanswers.Loop();
-
-    const vector<GetAnswers<HelperRequest,
-			    TryImproveResponse>::Work> &work =
-      getanswers.GetWork();
+    vector<TryImproveResponse> responses;
+    if (ports_.empty()) {
+      LocalAnswers(requests,
+		   [this](const HelperRequest &hreq, TryImproveResponse *res) {
+		     DoTryImprove(hreq.tryimprove(), res);
+		   },
+		   &responses);
+    } else {
+      GetAnswers<HelperRequest, TryImproveResponse>
+	getanswers(ports_, requests);
+      getanswers.Loop();
+
+      const vector<GetAnswers<HelperRequest,
+			      TryImproveResponse>::Work> &work =
+	getanswers.GetWork();
+      for (size_t i = 0; i < work.size(); ++i) {
+	responses.push_back(work[i].res);
+      }
+    }
 
     fprintf(log, "<li>Attempts at improving:\n<ul>");
     int numer = 0, denom = 0;
-    for (size_t i = 0; i < work.size(); ++i) {
-      const TryImproveRequest &req = work[i].req->tryimprove();
-      const TryImproveResponse &res = work[i].res;
+    for (size_t i = 0; i < responses.size(); ++i) {
+      const TryImproveRequest &req = requests[i].tryimprove();
+      const TryImproveResponse &res = responses[i];
       CHECK(res.score_size() == res.inputs_size());
       for (int j = 0; j < res.inputs_size(); j++) {
 	Replacement r;
@@ -1525,15 +2182,18 @@ struct PlayFun {
   }
 
   // Get a checkpoint that is at least MIN_BACKTRACK_DISTANCE inputs
-  // in the past, or return NULL.
-  Checkpoint *GetRecentCheckpoint() {
-    for (int i = checkpoints.size() - 1; i >= 0; i--) {
-      if ((movie.size() - checkpoints[i].movenum) > MIN_BACKTRACK_DISTANCE &&
-	  checkpoints[i].movenum > watermark) {
-	return &checkpoints[i];
+  // in the past, or return false.
+  bool GetRecentCheckpoint(Checkpoint *out) {
+    for (int i = checkpoints.Size() - 1; i >= 0; i--) {
+      const int movenum = checkpoints.MoveNum(i);
+      if ((movie.size() - movenum) > MIN_BACKTRACK_DISTANCE &&
+	  movenum > watermark) {
+	checkpoints.Get(i, &out->save);
+	out->movenum = movenum;
+	return true;
       }
     }
-    return NULL;
+    return false;
   }
 
 
@@ -1585,15 +2245,13 @@ struct PlayFun {
       //    variations on the sequence of N moves between start
       //    and now.
 
-      // Morally const, but need to load state from it.
-      Checkpoint *start_ptr = GetRecentCheckpoint();
-      if (start_ptr == NULL) {
+      // A copy, because stuff we do in here can truncate the
+      // checkpoints.
+      Checkpoint start;
+      if (!GetRecentCheckpoint(&start)) {
 	fprintf(stderr, "No checkpoint to try backtracking.\n");
 	return;
       }
-      // Copy, because stuff we do in here can resize the
-      // checkpoints array and cause disappointment.
-      Checkpoint start = *start_ptr;
 
       const size_t start_move = static_cast<size_t>(start.movenum);
       CHECK(start_move <= movie.size());
@@ -1729,6 +2387,8 @@ struct PlayFun {
 	movie,
 	subtitles);
     Emulator::PrintCacheStats();
+    Emulator::PrintCoreStats();
+    checkpoints.PrintStats();
   }
 
   void SaveQuickDiagnostics(const vector<Future> &futures) {
@@ -1764,6 +2424,14 @@ struct PlayFun {
   // Ports for the helpers.
   vector<int> ports_;
 
+  // When there are no helpers, the number of processes to fork
+  // to do the work locally.
+  int local_workers_;
+
+  // Futures in the first stage of successive halving, or 0 to score
+  // every next by every future.
+  int halving_futures_;
+
   // For making SVG.
   vector<Scoredist> distributions;
 
@@ -1806,20 +2474,37 @@ void PlayFun::Dualize(vector<uint8> *v, int start, int len) {
   }
 }
 
+auto PlayFun::SumEvaluations(double sum,
+                             vector<uint8> *previous_memory,
+                             vector< vector<uint8> > *memories,
+                             const vector< vector<uint8> > &changed)
+  -> double {
+  CHECK(changed.size() == memories->size());
+  for (size_t i = 0; i < memories->size(); i++) {
+    vector<uint8> &new_memory = (*memories)[i];
+    // Only objectives on RAM that changed this frame can move.
+    sum += objectives->EvaluateChanged(*previous_memory, new_memory,
+                                       changed[i].data());
+    previous_memory->swap(new_memory);
+  }
+  return sum;
+}
+
 auto PlayFun::ScoreIntegral(vector<uint8> *start_state,
                             const vector<uint8> &inputs,
                             vector<uint8> *final_memory) -> double {
-  Emulator::LoadUncompressed(start_state);
+  if (start_state != nullptr) {
+    Emulator::LoadUncompressed(start_state);
+  } else {
+    Emulator::RestoreBase();
+  }
   vector<uint8> previous_memory;
   Emulator::GetMemory(&previous_memory);
-  double sum = 0.0;
-  for (size_t i = 0; i < inputs.size(); ++i) {
-    Emulator::CachingStep(inputs[i]);
-    vector<uint8> new_memory;
-    Emulator::GetMemory(&new_memory);
-    sum += objectives->Evaluate(previous_memory, new_memory);
-    previous_memory.swap(new_memory);
-  }
+  // Futures often repeat a prefix (mutants keep their parent's first
+  // half), so let the sequence cache skip what it can.
+  vector< vector<uint8> > memories, changed;
+  Emulator::CachingSteps(inputs, &memories, &changed);
+  double sum = SumEvaluations(0.0, &previous_memory, &memories, changed);
   if (final_memory != nullptr) {
     final_memory->swap(previous_memory);
   }
@@ -0,0 +1,260 @@
+#include "sharedcache.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const uint32 SHARED_MAGIC = 0x53484353;  // "SCHS"
+static const uint32 SHARED_VERSION = 1;
+// The index and the slab start on their own pages.
+static const uint64 HEADER_BYTES = 4096;
+static const uint32 ENTRY_MAGIC = 0x59544E45;  // "ENTY"
+// A slot for about every this many bytes of slab.
+static const uint64 BYTES_PER_SLOT = 256;
+// Counts are added to the header's this often, so that processes
+// don't all fight over its cache line.
+static const uint64 FLUSH_EVERY = 4096;
+
+enum { HITS, MISSES, PUTS, FULL };
+
+// At the start of the segment. Everything but the counts is fixed
+// once it's made.
+struct SharedCache::Header {
+  uint32 magic;
+  uint32 version;
+  uint64 game;
+  uint64 bytes;
+  uint64 slots;
+  // Where the slab starts, and the end of what's been taken from it
+  // (which can pass the end of the segment, once it's full).
+  uint64 slab;
+  uint64 next;
+  // Slots claimed.
+  uint64 count;
+  // Everyone's counts, indexed as above.
+  uint64 counts[4];
+};
+
+// An empty slot has k0 == 0. A claimed one whose entry isn't
+// written yet has offset == 0. The rest of the key is in the entry.
+struct SharedCache::Slot {
+  uint64 k0;
+  uint64 offset;
+};
+
+namespace {
+// Followed by the data, then padding to 8 bytes.
+struct EntryHeader {
+  uint64 k0, k1;
+  uint32 size;
+  uint32 magic;
+};
+
+// Takes an flock for as long as it lives.
+struct Lock {
+  explicit Lock(int fd) : fd(fd) { CHECK(0 == flock(fd, LOCK_EX)); }
+  ~Lock() { flock(fd, LOCK_UN); }
+  int fd;
+};
+}
+
+static inline uint64 Load64(const uint64 *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void Store64(uint64 *p, uint64 v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static inline uint64 Add64(uint64 *p, uint64 v) {
+  return __atomic_fetch_add(p, v, __ATOMIC_RELAXED);
+}
+
+SharedCache::SharedCache()
+  : bytes(0ULL), data(NULL), header(NULL), slots(NULL), mask(0ULL),
+    hits(0ULL), misses(0ULL), puts(0ULL), full(0ULL) {
+  for (int i = 0; i < 4; i++) unflushed[i] = 0ULL;
+}
+
+SharedCache::~SharedCache() {
+  if (data != NULL) {
+    Flush();
+    munmap(data, bytes);
+  }
+}
+
+SharedCache *SharedCache::Open(const string &name, uint64 game,
+			       uint64 bytes) {
+  const string shmname = "/" + name;
+  const int fd = shm_open(shmname.c_str(), O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "Couldn't open shared cache %s\n", name.c_str());
+    abort();
+  }
+
+  // Only one process sets it up; the rest wait here and then see
+  // that it's the right size.
+  struct stat st;
+  {
+    Lock lock(fd);
+    CHECK(0 == fstat(fd, &st));
+    if (st.st_size == 0) {
+      uint64 nslots = 1;
+      while (nslots * 2 * BYTES_PER_SLOT <= bytes) nslots <<= 1;
+      const uint64 slab = HEADER_BYTES +
+	((nslots * sizeof (Slot) + HEADER_BYTES - 1) & ~(HEADER_BYTES - 1));
+      if (slab >= bytes) {
+	fprintf(stderr, "Shared cache %s would be too small\n",
+		name.c_str());
+	abort();
+      }
+      // Pages are zero until touched, so that's every slot empty.
+      CHECK(0 == ftruncate(fd, bytes));
+      Header h;
+      memset(&h, 0, sizeof (h));
+      h.magic = SHARED_MAGIC;
+      h.version = SHARED_VERSION;
+      h.game = game;
+      h.bytes = bytes;
+      h.slots = nslots;
+      h.slab = slab;
+      h.next = slab;
+      CHECK(pwrite(fd, &h, sizeof (h), 0) == (ssize_t)sizeof (h));
+      st.st_size = bytes;
+    }
+  }
+
+  SharedCache *c = new SharedCache;
+  c->name = name;
+  c->bytes = st.st_size;
+  void *m = mmap(NULL, c->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    fprintf(stderr, "Couldn't map shared cache %s\n", name.c_str());
+    abort();
+  }
+  c->data = (uint8 *)m;
+  c->header = (Header *)m;
+
+  if (c->header->magic != SHARED_MAGIC ||
+      c->header->version != SHARED_VERSION ||
+      c->header->bytes != c->bytes) {
+    fprintf(stderr, "%s isn't a shared cache\n", name.c_str());
+    abort();
+  }
+  if (c->header->game != game) {
+    fprintf(stderr, "Shared cache %s is for a different game\n",
+	    name.c_str());
+    abort();
+  }
+  c->slots = (Slot *)(c->data + HEADER_BYTES);
+  c->mask = c->header->slots - 1;
+  return c;
+}
+
+void SharedCache::Flush() {
+  for (int i = 0; i < 4; i++) {
+    if (unflushed[i] > 0) Add64(&header->counts[i], unflushed[i]);
+    unflushed[i] = 0ULL;
+  }
+}
+
+bool SharedCache::Find(uint64 k0, uint64 k1, const uint8 **out,
+		       uint32 *size) {
+  if ((hits + misses) % FLUSH_EVERY == 0) Flush();
+  for (uint64 n = 0, i = k0 & mask; n <= mask; n++, i = (i + 1) & mask) {
+    const uint64 s0 = Load64(&slots[i].k0);
+    if (s0 == 0) break;
+    if (s0 != k0) continue;
+    const uint64 offset = Load64(&slots[i].offset);
+    if (offset == 0) break;
+    const EntryHeader *e = (const EntryHeader *)(data + offset);
+    if (e->magic == ENTRY_MAGIC && e->k0 == k0 && e->k1 == k1) {
+      *out = data + offset + sizeof (EntryHeader);
+      *size = e->size;
+      hits++;
+      unflushed[HITS]++;
+      return true;
+    }
+    // Same k0, different key; keep looking.
+  }
+  misses++;
+  unflushed[MISSES]++;
+  return false;
+}
+
+bool SharedCache::Put(uint64 k0, uint64 k1, const uint8 *in, uint32 size) {
+  CHECK(k0 != 0);
+  // Keep the index at most three quarters full, so probes stay short.
+  if (Load64(&header->count) >= header->slots / 4 * 3) {
+    full++;
+    unflushed[FULL]++;
+    return false;
+  }
+
+  // Claim a slot first, so that processes adding the same entry at
+  // the same time don't each take space for it.
+  uint64 i = k0 & mask;
+  for (uint64 n = 0; ; n++, i = (i + 1) & mask) {
+    if (n > mask) return false;
+    uint64 s0 = 0;
+    if (__atomic_compare_exchange_n(&slots[i].k0, &s0, k0, false,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      break;
+    if (s0 != k0) continue;
+    // Someone has (or is adding) this key already.
+    const uint64 other = Load64(&slots[i].offset);
+    if (other == 0 || ((const EntryHeader *)(data + other))->k1 == k1)
+      return false;
+    // Same k0, different key; keep looking.
+  }
+  Add64(&header->count, 1);
+
+  const uint64 need = (sizeof (EntryHeader) + size + 7) & ~7ULL;
+  const uint64 offset = Add64(&header->next, need);
+  if (offset + need > bytes) {
+    // The slot stays claimed and empty, which just means a miss.
+    full++;
+    unflushed[FULL]++;
+    return false;
+  }
+
+  EntryHeader *e = (EntryHeader *)(data + offset);
+  e->k0 = k0;
+  e->k1 = k1;
+  e->size = size;
+  e->magic = ENTRY_MAGIC;
+  memcpy(data + offset + sizeof (EntryHeader), in, size);
+  // Publishes the entry.
+  Store64(&slots[i].offset, offset);
+  puts++;
+  unflushed[PUTS]++;
+  return true;
+}
+
+void SharedCache::PrintStats() {
+  Flush();
+  const uint64 *all = header->counts;
+  const uint64 used = Load64(&header->next) - header->slab;
+  const uint64 slab = bytes - header->slab;
+  printf("Shared cache %s: %.1f / %.1f MB, %llu index slots used of %llu\n"
+	 "  this process: %llu hits and %llu misses (%.1f%%); "
+	 "%llu puts, %llu when full\n"
+	 "  everyone: %llu hits and %llu misses (%.1f%%); "
+	 "%llu puts, %llu when full\n",
+	 name.c_str(), (used < slab ? used : slab) / (1024.0 * 1024.0),
+	 slab / (1024.0 * 1024.0),
+	 (unsigned long long)Load64(&header->count),
+	 (unsigned long long)header->slots,
+	 (unsigned long long)hits, (unsigned long long)misses,
+	 hits + misses > 0 ? (100.0 * hits) / (hits + misses) : 0.0,
+	 (unsigned long long)puts, (unsigned long long)full,
+	 (unsigned long long)all[HITS], (unsigned long long)all[MISSES],
+	 all[HITS] + all[MISSES] > 0 ?
+	 (100.0 * all[HITS]) / (all[HITS] + all[MISSES]) : 0.0,
+	 (unsigned long long)all[PUTS], (unsigned long long)all[FULL]);
+}
@@ -0,0 +1,63 @@
+/* A cache of emulator steps in POSIX shared memory, so that every
+   playfun process on a machine (the master, helpers and forked
+   workers) sees the results of steps any of them has run. It's a
+   fixed-size segment: a header, an open-addressing index of
+   (key, offset) slots, and a slab that entries are carved from in
+   order. It's only ever added to. Space is taken from the slab with
+   an atomic add and slots are claimed with compare-and-swap, so no
+   one ever waits for a lock; readers check each entry they find, and
+   treat one that's still being written as a miss. Once the slab or
+   the index fills up, new entries are dropped.
+
+   Keys and entries are just bytes here; Emulator decides what they
+   mean. The segment stays around until it's removed (with shm_unlink
+   or from /dev/shm) or the machine restarts, so a later run of the
+   same game can use it too. */
+
+#ifndef __TASBOT_SHAREDCACHE_H
+#define __TASBOT_SHAREDCACHE_H
+
+#include <string>
+
+#include "tasbot.h"
+
+struct SharedCache {
+  // Opens the segment with this name (no slash), creating it with
+  // the given size if it doesn't exist. game identifies what the
+  // entries are for; it's an error to open a segment made for a
+  // different one. Aborts on failure.
+  static SharedCache *Open(const string &name, uint64 game, uint64 bytes);
+  ~SharedCache();
+
+  // Sets *data and *size to the entry with the key, which stays valid
+  // as long as this is open. Returns false if there isn't one.
+  bool Find(uint64 k0, uint64 k1, const uint8 **data, uint32 *size);
+
+  // Adds an entry, unless there already is one with the key (or one
+  // is being added right now). Returns false if it wasn't added.
+  bool Put(uint64 k0, uint64 k1, const uint8 *data, uint32 size);
+
+  // This process's counts, and everyone's.
+  void PrintStats();
+
+ private:
+  struct Header;
+  struct Slot;
+
+  SharedCache();
+  // Adds this process's counts since the last flush to the header's.
+  void Flush();
+
+  string name;
+  uint64 bytes;
+  uint8 *data;
+  Header *header;
+  Slot *slots;
+  uint64 mask;
+
+  uint64 hits, misses, puts, full;
+  // Not flushed yet.
+  uint64 unflushed[4];
+};
+
+#endif
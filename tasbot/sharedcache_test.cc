@@ -0,0 +1,115 @@
+/* Tests for the shared-memory step cache. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "tasbot.h"
+#include "../cc-lib/util.h"
+#include "../cc-lib/arcfour.h"
+#include "sharedcache.h"
+
+static const uint64 GAME = 0x5EEDULL;
+
+// Everything about entry i is a function of i. Some keys share k0.
+static void MakeEntry(int i, uint64 *k0, uint64 *k1, vector<uint8> *data) {
+  ArcFour rc(StringPrintf("entry%d", i));
+  *k0 = 1 + i / 2;
+  *k1 = 0x1000 + i;
+  data->resize(1 + rc.Byte() * 3);
+  for (int j = 0; j < data->size(); j++) (*data)[j] = rc.Byte();
+}
+
+// If it's not required, it may be missing (another process may be
+// writing it), but if it's there it has to be right.
+static void CheckEntry(SharedCache *c, int i, bool required = true) {
+  uint64 k0, k1;
+  vector<uint8> data;
+  MakeEntry(i, &k0, &k1, &data);
+  const uint8 *got;
+  uint32 size;
+  if (!c->Find(k0, k1, &got, &size)) {
+    CHECK(!required);
+    return;
+  }
+  CHECK(vector<uint8>(got, got + size) == data);
+}
+
+static void PutEntries(SharedCache *c, int start, int end) {
+  for (int i = start; i < end; i++) {
+    uint64 k0, k1;
+    vector<uint8> data;
+    MakeEntry(i, &k0, &k1, &data);
+    c->Put(k0, k1, &data[0], data.size());
+  }
+}
+
+int main(int argc, char *argv[]) {
+  fprintf(stderr, "Testing shared cache.\n");
+  const string name = StringPrintf("sharedcache_test-%d", (int)getpid());
+  const string small = name + "-small";
+
+  {
+    SharedCache *c = SharedCache::Open(name, GAME, 16 << 20);
+    const uint8 *got;
+    uint32 size;
+    CHECK(!c->Find(1, 2, &got, &size));
+    PutEntries(c, 0, 1000);
+    for (int i = 0; i < 1000; i++) CheckEntry(c, i);
+    // Already there.
+    uint64 k0, k1;
+    vector<uint8> data;
+    MakeEntry(5, &k0, &k1, &data);
+    CHECK(!c->Put(k0, k1, &data[0], data.size()));
+    CheckEntry(c, 5);
+    delete c;
+  }
+
+  // Writers in other processes, all putting the same entries at once.
+  {
+    SharedCache *c = SharedCache::Open(name, GAME, 16 << 20);
+    static const int kProcs = 4;
+    for (int p = 0; p < kProcs; p++) {
+      if (fork() == 0) {
+	SharedCache *d = SharedCache::Open(name, GAME, 16 << 20);
+	PutEntries(d, 1000, 20000);
+	for (int i = 0; i < 20000; i += 7) CheckEntry(d, i, i < 1000);
+	delete d;
+	_exit(0);
+      }
+    }
+    for (int p = 0; p < kProcs; p++) {
+      int status = 0;
+      CHECK(wait(&status) > 0);
+      CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    // Whoever put them, they're all there now.
+    for (int i = 0; i < 20000; i++) CheckEntry(c, i);
+    c->PrintStats();
+    delete c;
+  }
+
+  // Full: no more puts, but everything is still there.
+  {
+    SharedCache *c = SharedCache::Open(small, GAME, 256 << 10);
+    int n = 0;
+    for (;; n++) {
+      uint64 k0, k1;
+      vector<uint8> data;
+      MakeEntry(n, &k0, &k1, &data);
+      if (!c->Put(k0, k1, &data[0], data.size())) break;
+    }
+    CHECK(n > 100);
+    for (int i = 0; i < n; i++) CheckEntry(c, i);
+    c->PrintStats();
+    delete c;
+  }
+
+  shm_unlink(("/" + name).c_str());
+  shm_unlink(("/" + small).c_str());
+  fprintf(stderr, "OK.\n");
+  return 0;
+}
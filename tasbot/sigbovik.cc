@@ -124,9 +124,9 @@ struct Sigbovik {
 
     // XXX configure this via config.txt
     // For 64-bit machines with loads of ram
-    // Emulator::ResetCache(100000, 10000);
+    // Emulator::ResetCache(1024ULL << 20);
     // For modest systems
-    Emulator::ResetCache(1, 1);
+    Emulator::ResetCache(1ULL << 20);
 
     #if 0
     solution = SimpleFM2::ReadInputs(moviename);
@@ -60,17 +60,18 @@
    most nodes. If the savestate is not present, we back up
    the graph to the most recent predecessor that has a savestate,
    then replay the inputs in order to load this node. This trades
-   off time for space.
+   off time for space. Each node holds a StateHandle (emulator.h),
+   which does exactly that and decides which ones to keep.
 
 
 */
 struct Node : public Heapable {
-  // If NULL, then this is the root state. It MUST have
-  // saved state.
+  // If NULL, then this is the root state.
   Node *prev;
-  // Optional new-ly allocated savestate, owned by this node.
-  // It can be cleared at any time, unless prev is NULL.
-  vector<uint8> *savestate;
+  // The state, as a handle from the nearest materialized ancestor
+  // (which isn't necessarily along prev, since prev can change when
+  // the node is rediscovered).
+  StateHandle state;
 
   // The input issued to get from the previous state
   // to this state. Meaningless if this is the root node.
@@ -248,11 +249,10 @@ static auto MakeNode(Node *prev, uint8 input) -> Node * {
   // Note, ignored if prev == NULL.
   n->input = input;
 
-  // XXX decide whether to make savestate, like by
-  // tracing backwards or computing parity of distance
-  // or whatever.
-  n->savestate = new vector<uint8>;
-  Emulator::SaveEx(n->savestate, basis);
+  // The emulator is in the new state, so the handle policy can
+  // decide whether to materialize it.
+  n->state = (prev == nullptr) ? StateHandle::Save() :
+    prev->state.After(input);
 
   n->heuristic = GetHeuristic();
   return n;
@@ -274,13 +274,7 @@ static void LoadNode(const Node *n) {
     abort();
   }
 
-  if (n->savestate == nullptr) {
-    // Recurse and replay inputs on the way back.
-    LoadNode(n->prev);
-    Emulator::Step(n->input);
-  } else {
-    Emulator::LoadEx(n->savestate, basis);
-  }
+  n->state.Load();
 }
 
 static void WriteMovie(const string &moviename,
@@ -389,6 +383,7 @@ auto main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[]) -> int {
       char name[512];
       sprintf(name, "prog%lu-%d", processed, explore->distance);
       WriteMovie(name, start_inputs, explore);
+      StateHandle::PrintStats();
     }
 
     if (explore->distance > deepest) {
@@ -431,8 +426,6 @@ auto main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[]) -> int {
     for (unsigned char input : next) {
       // Only way to try a new input is to load the explore node
       // and make a step.
-      // PERF: Should probably have LoadNode return the save state
-      // so that we don't have to keep replaying.
       LoadNode(explore);
       Emulator::Step(input);
 
@@ -40,6 +40,28 @@ WeightedObjectives::WeightedObjectives(const vector< vector<int> > &objs) {
   for (int i = 0; i < objs.size(); i++) {
     weighted[objs[i]] = new Info(1.0);
   }
+  BuildIndex();
+}
+
+void WeightedObjectives::BuildIndex() {
+  ordered.clear();
+  users.clear();
+  users.resize(0x800);
+  always.clear();
+  for (Weighted::const_iterator it = weighted.begin();
+       it != weighted.end(); ++it) {
+    const int idx = ordered.size();
+    ordered.push_back(make_pair(&it->first, it->second));
+    for (int p : it->first) {
+      if (p < 0 || p >= 0x800) {
+        always.push_back(idx);
+        continue;
+      }
+      // Locations can repeat within an objective.
+      if (users[p].empty() || users[p].back() != idx)
+        users[p].push_back(idx);
+    }
+  }
 }
 
 static string ObjectiveToString(const vector<int> &obj) {
@@ -73,6 +95,7 @@ WeightedObjectives::LoadFromFile(const string &filename) {
     }
   }
 
+  wo->BuildIndex();
   return wo;
 }
 
@@ -195,6 +218,39 @@ double WeightedObjectives::Evaluate(const vector<uint8> &mem1,
   return score;
 }
 
+double WeightedObjectives::EvaluateChanged(const vector<uint8> &mem1,
+                                           const vector<uint8> &mem2,
+                                           const uint8 *changed) const {
+  vector<int> todo = always;
+  for (int b = 0; b < 0x800 / 8; b++) {
+    if (changed[b] == 0) continue;
+    for (int i = 0; i < 8; i++) {
+      if (changed[b] & (1 << i)) {
+        const vector<int> &u = users[b * 8 + i];
+        todo.insert(todo.end(), u.begin(), u.end());
+      }
+    }
+  }
+
+  // Add them up in the same order as Evaluate, so that the result is
+  // exactly the same.
+  std::sort(todo.begin(), todo.end());
+  todo.erase(std::unique(todo.begin(), todo.end()), todo.end());
+
+  double score = 0.0;
+  for (int idx : todo) {
+    const vector<int> &objective = *ordered[idx].first;
+    const double weight = ordered[idx].second->weight;
+    switch (Order(mem1, mem2, objective)) {
+    case -1: score -= weight; break;
+    case 1: score += weight; break;
+    case 0:
+    default:;
+    }
+  }
+  return score;
+}
+
 #if 0
 // XXX can probably simplify this, but should probably just remove it.
 double WeightedObjectives::BuggyEvaluate(const vector<uint8> &mem1,
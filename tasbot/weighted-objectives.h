@@ -40,6 +40,14 @@ struct WeightedObjectives {
   double Evaluate(const vector<uint8> &mem1,
                   const vector<uint8> &mem2) const;
 
+  // Same result as Evaluate, but only looks at the objectives that
+  // use a location whose bit is set in changed (0x800 bits, as in
+  // Emulator::GetChangedBits). The caller promises that mem1 and mem2
+  // are equal everywhere else.
+  double EvaluateChanged(const vector<uint8> &mem1,
+                         const vector<uint8> &mem2,
+                         const uint8 *changed) const;
+
   // Observe a game state. This informs us about the values that
   // the objective functions can take on, which lets us score the
   // magnitude of their changes. Not necessary for GetNumLess() or
@@ -75,6 +83,14 @@ struct WeightedObjectives {
   typedef std::map< std::vector<int>, Info* > Weighted;
   Weighted weighted;
 
+  // For EvaluateChanged. The objectives in map order, and for each
+  // memory location, the indices of the objectives that use it.
+  // Objectives with a location outside RAM are always evaluated.
+  void BuildIndex();
+  std::vector< std::pair<const std::vector<int> *, const Info *> > ordered;
+  std::vector< std::vector<int> > users;
+  std::vector<int> always;
+
   NOT_COPYABLE(WeightedObjectives);
 };
 
@@ -10,7 +10,47 @@
 #include "../cc-lib/arcfour.h"
 #include "weighted-objectives.h"
 
-int main(int argc, char *argv[]) {
+// EvaluateChanged must give exactly what Evaluate does, as long as
+// the memories only differ at changed locations.
+static void TestEvaluateChanged() {
+  ArcFour rc("evaluate");
+  vector< vector<int> > objs;
+  for (int i = 0; i < 200; i++) {
+    vector<int> obj;
+    const int len = 1 + rc.Byte() % 6;
+    for (int j = 0; j < len; j++)
+      obj.push_back(((rc.Byte() << 8) | rc.Byte()) % 0x800);
+    objs.push_back(obj);
+  }
+  WeightedObjectives wo(objs);
+
+  for (int trial = 0; trial < 1000; trial++) {
+    vector<uint8> mem1(0x800), mem2;
+    for (int i = 0; i < 0x800; i++) mem1[i] = rc.Byte();
+    mem2 = mem1;
+    uint8 changed[0x800 / 8] = {0};
+    const int num = rc.Byte() % 64;
+    for (int i = 0; i < num; i++) {
+      // Pick locations that objectives use, mostly.
+      const vector<int> &obj = objs[rc.Byte() % objs.size()];
+      const int p = (rc.Byte() & 7) ? obj[rc.Byte() % obj.size()] :
+	((rc.Byte() << 8) | rc.Byte()) % 0x800;
+      changed[p >> 3] |= 1 << (p & 7);
+      // Sometimes marked but the same.
+      if (rc.Byte() & 3) mem2[p] = rc.Byte();
+    }
+    const double full = wo.Evaluate(mem1, mem2);
+    const double part = wo.EvaluateChanged(mem1, mem2, changed);
+    if (full != part) {
+      fprintf(stderr, "Trial %d: Evaluate %f but EvaluateChanged %f\n",
+	      trial, full, part);
+      abort();
+    }
+  }
+  fprintf(stderr, "EvaluateChanged ok.\n");
+}
 
+int main(int argc, char *argv[]) {
+  TestEvaluateChanged();
   return 0;
 }